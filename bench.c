@@ -0,0 +1,322 @@
+/*
+ * Microbenchmarks for refc.h
+ *
+ * Build with: cc -std=c11 -O2 bench.c -o bench -lpthread
+ * Run with:   ./bench [threads] [iterations]
+ *
+ * Latencies are measured over batches of BATCH operations, as single
+ * operations are too short for the clock, and reported as percentiles
+ * of the batches.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define REFC_H_IMPLEMENTATION
+#include "refc.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Operations per latency sample */
+#define BATCH 100
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Disposes of deferred blocks so that destruction is part of the measurement */
+static void drain(void) {
+#if defined(REFC_H_EPOCH) && defined(REFC_H_DEFERRED)
+	do {
+		refc_epoch_synchronize();
+	} while (refc_drain((size_t) -1) > 0);
+#elif defined(REFC_H_EPOCH)
+	refc_epoch_synchronize();
+#elif defined(REFC_H_DEFERRED)
+	refc_drain((size_t) -1);
+#endif
+}
+
+/* Nanoseconds per operation of each batch */
+struct latencies {
+	double *ns;
+	size_t count;
+};
+
+static struct latencies latencies_create(size_t batches) {
+	struct latencies l = { malloc(batches * sizeof(double)), 0 };
+	return l;
+}
+
+/* Adds the latency of a batch that made `ops` operations */
+static void latencies_add(struct latencies *l, double elapsed, size_t ops) {
+	l->ns[l->count++] = elapsed * 1e9 / ops;
+}
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * The previous refc_release: a relaxed decrement followed by a separate
+ * load of the count. Kept here as a baseline, it is not thread-safe.
+ */
+static atomic_size_t split_count;
+
+static void split_retain(void) {
+	atomic_fetch_add_explicit(&split_count, 1, memory_order_relaxed);
+}
+
+static int split_release(void) {
+	atomic_fetch_sub_explicit(&split_count, 1, memory_order_relaxed);
+	return atomic_load_explicit(&split_count, memory_order_relaxed) == 0;
+}
+
+struct contended {
+	struct refc_ref *ref;
+	size_t iterations;
+	atomic_bool start;
+
+	/* Latencies of all threads, guarded by lock */
+	struct latencies latencies;
+	atomic_bool lock;
+};
+
+static void *contended_split(void *arg) {
+	struct contended *c = arg;
+	while (!atomic_load(&(c->start))) {
+	}
+	for (size_t i = 0; i < c->iterations; i++) {
+		split_retain();
+		split_release();
+	}
+	return NULL;
+}
+
+#ifndef REFC_H_SINGLE_THREADED
+static void *contended_refc(void *arg) {
+	struct contended *c = arg;
+	struct latencies l = latencies_create(c->iterations / BATCH);
+	while (!atomic_load(&(c->start))) {
+	}
+	for (size_t i = 0; i + BATCH <= c->iterations; i += BATCH) {
+		double start = now();
+		for (size_t j = 0; j < BATCH; j++) {
+			refc_retain(c->ref);
+			refc_release(c->ref);
+		}
+		latencies_add(&l, now() - start, BATCH * 2);
+	}
+
+	while (atomic_exchange(&(c->lock), 1)) {
+	}
+	for (size_t i = 0; i < l.count; i++) {
+		c->latencies.ns[c->latencies.count++] = l.ns[i];
+	}
+	atomic_store(&(c->lock), 0);
+	free(l.ns);
+	return NULL;
+}
+#endif
+
+/*
+ * Runs `body` on `threads` threads retaining and releasing a single shared ref.
+ * The ref is allocated with `flags`, see refc_allocate_flags.
+ * Latencies of the batches of all threads are added to `latencies` if not NULL.
+ */
+static double run_contended(void *(*body)(void *), size_t threads, size_t iterations,
+		unsigned int flags, struct latencies *latencies) {
+	pthread_t *ids = malloc(threads * sizeof(pthread_t));
+	struct contended c = { refc_allocate_flags(64, NULL, flags), iterations, 0,
+		latencies_create(threads * (iterations / BATCH)), 0 };
+	atomic_store(&split_count, 1);
+
+	for (size_t i = 0; i < threads; i++) {
+		pthread_create(&ids[i], NULL, body, &c);
+	}
+	double start = now();
+	atomic_store(&(c.start), 1);
+	for (size_t i = 0; i < threads; i++) {
+		pthread_join(ids[i], NULL);
+	}
+	double elapsed = now() - start;
+
+#ifdef REFC_H_SHARDED
+	refc_unshard(c.ref);
+#endif
+	refc_release(c.ref);
+	free(ids);
+	if (latencies != NULL) {
+		*latencies = c.latencies;
+	} else {
+		free(c.latencies.ns);
+	}
+	return elapsed;
+}
+
+static void report(const char *name, size_t ops, double elapsed) {
+	printf("%-32s %12.0f ops/s %8.2f ns/op\n", name, ops / elapsed, elapsed * 1e9 / ops);
+}
+
+/* Reports the percentiles of a set of latencies and frees it */
+static void report_latencies(const char *name, struct latencies *l) {
+	if (l->count == 0) {
+		free(l->ns);
+		return;
+	}
+	qsort(l->ns, l->count, sizeof(double), compare_double);
+	printf("%-32s p50 %8.2f p99 %8.2f p99.9 %8.2f ns/op\n", name,
+			l->ns[l->count / 2], l->ns[l->count * 99 / 100], l->ns[l->count * 999 / 1000]);
+	free(l->ns);
+}
+
+/* Allocates and releases blocks of `size` bytes, keeping up to BATCH of them alive */
+static void bench_allocate(size_t size, size_t iterations) {
+	struct refc_ref *refs[BATCH];
+	struct latencies l = latencies_create(iterations / BATCH);
+	double start = now();
+	for (size_t i = 0; i + BATCH <= iterations; i += BATCH) {
+		double batch = now();
+		for (size_t j = 0; j < BATCH; j++) {
+			refs[j] = refc_allocate(size);
+		}
+		for (size_t j = 0; j < BATCH; j++) {
+			refc_release(refs[j]);
+		}
+		drain();
+		latencies_add(&l, now() - batch, BATCH);
+	}
+	double elapsed = now() - start;
+
+	char name[64];
+	snprintf(name, sizeof(name), "allocate/release %zu bytes", size);
+	report(name, iterations / BATCH * BATCH, elapsed);
+	report_latencies(name, &l);
+}
+
+/* Retains and releases a block that no other thread uses */
+static void bench_uncontended(size_t iterations) {
+	struct refc_ref *ref = refc_allocate(64);
+	struct latencies l = latencies_create(iterations / BATCH);
+	double start = now();
+	for (size_t i = 0; i + BATCH <= iterations; i += BATCH) {
+		double batch = now();
+		for (size_t j = 0; j < BATCH; j++) {
+			refc_retain(ref);
+			refc_release(ref);
+		}
+		latencies_add(&l, now() - batch, BATCH * 2);
+	}
+	double elapsed = now() - start;
+	refc_release(ref);
+
+	report("uncontended retain/release", iterations / BATCH * BATCH * 2, elapsed);
+	report_latencies("uncontended retain/release", &l);
+}
+
+/* Number of children stored in the blocks of build_tree */
+static size_t tree_arity;
+
+/* Releases the children stored in a block, NULL for none */
+static void release_children(void *block) {
+	struct refc_ref **children = block;
+	for (size_t i = 0; i < tree_arity; i++) {
+		if (children[i] != NULL) {
+			refc_release(children[i]);
+		}
+	}
+}
+
+/* Builds a tree of `depth` levels where each block holds `arity` children */
+static struct refc_ref *build_tree(size_t arity, size_t depth) {
+	struct refc_ref *ref = refc_allocate_dtor(arity * sizeof(struct refc_ref *), &release_children);
+	struct refc_ref **children = refc_access(ref);
+	for (size_t i = 0; i < arity; i++) {
+		children[i] = depth > 1 ? build_tree(arity, depth - 1) : NULL;
+	}
+	return ref;
+}
+
+/* Measures releasing the root of a tree, which destructs all of its blocks */
+static void bench_cascade(const char *name, size_t arity, size_t depth, size_t blocks) {
+	tree_arity = arity;
+	struct refc_ref *root = build_tree(arity, depth);
+	double start = now();
+	refc_release(root);
+	drain();
+	report(name, blocks, now() - start);
+}
+
+#if defined(REFC_H_DEBUG) || defined(REFC_H_COLLECT)
+/*
+ * Links a growing graph of blocks, each new block as the child of a random
+ * earlier one, and reports the cost of the links made at each size.
+ */
+static void bench_link(size_t blocks) {
+	struct refc_ref **refs = malloc(blocks * sizeof(struct refc_ref *));
+	refs[0] = refc_allocate(16);
+	size_t linked = 1;
+	unsigned int seed = 1;
+	for (size_t size = 1000; size <= blocks; size *= 10) {
+		size_t from = linked;
+		double start = now();
+		for (; linked < size; linked++) {
+			refs[linked] = refc_allocate(16);
+			seed = seed * 1103515245 + 12345;
+			refc_link(refs[(seed >> 8) % linked], refs[linked]);
+		}
+		char name[64];
+		snprintf(name, sizeof(name), "refc_link up to %zu blocks", size);
+		report(name, size - from, now() - start);
+	}
+	for (size_t i = 0; i < linked; i++) {
+		refc_release(refs[i]);
+	}
+	drain();
+	free(refs);
+}
+#endif
+
+int main(int argc, char **argv) {
+	size_t threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+	size_t iterations = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+	size_t ops = threads * iterations * 2;
+
+	printf("allocation\n");
+	for (size_t size = 16; size <= 4096; size *= 4) {
+		bench_allocate(size, iterations);
+	}
+
+	printf("\nretain/release of an unshared ref\n");
+	bench_uncontended(iterations);
+
+	printf("\nretain/release of a shared ref, %zu threads\n", threads);
+	report("split decrement and load", ops, run_contended(contended_split, threads, iterations, 0, NULL));
+	/* Blocks cannot be shared between threads with REFC_H_SINGLE_THREADED */
+#ifndef REFC_H_SINGLE_THREADED
+	struct latencies l;
+	report("refc_retain/refc_release", ops, run_contended(contended_refc, threads, iterations, 0, &l));
+	report_latencies("refc_retain/refc_release", &l);
+#endif
+#ifdef REFC_H_SHARDED
+	report("sharded retain/release", ops,
+			run_contended(contended_refc, threads, iterations, REFC_ALLOCATE_SHARDED, &l));
+	report_latencies("sharded retain/release", &l);
+#endif
+
+	/* Lists are kept short enough for recursive destruction */
+	printf("\ncascading destruction\n");
+	bench_cascade("list of 10000 blocks", 1, 10000, 10000);
+	bench_cascade("binary tree of 2^17-1 blocks", 2, 17, (1 << 17) - 1);
+
+#if defined(REFC_H_DEBUG) || defined(REFC_H_COLLECT)
+	printf("\nlinking\n");
+	bench_link(100000);
+#endif
+	return 0;
+}
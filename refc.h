@@ -29,6 +29,76 @@
  * pointers that are obtained otherwise.
  *
  * Check the `refc_link` and `refc_unlink` functions for cycle detection.
+ *
+ * Compile-time options, defined before including this header:
+ *
+ * REFC_H_DEBUG - track parent-child links and detect reference cycles.
+ *                Keeps a registry of live blocks for finding leaks, see
+ *                `refc_debug_report`. With REFC_H_COLLECT links closing a
+ *                cycle are accepted and the cycles collected instead.
+ * REFC_H_COLLECT - track parent-child links and reclaim unreachable
+ *                reference cycles, see `refc_collect`. Cannot be combined
+ *                with REFC_H_BIASED.
+ * REFC_H_POOL  - serve small blocks from per-size-class free lists
+ *                instead of calling malloc and free for every block.
+ *                Each thread caches free blocks of its own; blocks released
+ *                on another thread are handed back to the allocating thread.
+ *                Requires pthreads.
+ * REFC_H_POOL_SLAB_SIZE - the size of the chunks that are carved into blocks
+ *                of a single size class. Defaults to 64 KiB.
+ * REFC_H_POOL_CACHE_SIZE - the number of free blocks per size class that
+ *                each thread keeps to itself. Defaults to 64.
+ * REFC_H_SINGLE_THREADED - use plain instead of atomic reference counts.
+ *                All retains and releases of a block must happen on the
+ *                thread that allocated it, which REFC_H_DEBUG asserts.
+ * REFC_H_BIASED - use biased reference counting. The thread that allocates
+ *                a block counts its references without atomic operations,
+ *                other threads use a shared atomic count. A block whose last
+ *                reference is released by another thread is disposed of on
+ *                the owning thread's next release. Requires pthreads.
+ * REFC_H_DEFERRED - queue blocks that reach a reference count of 0 instead
+ *                of disposing of them in refc_release, see `refc_drain`.
+ * REFC_H_ITERATIVE - dispose of blocks released by destructors in a loop
+ *                in the outermost refc_release instead of recursively,
+ *                so that releasing long chains uses constant stack space.
+ *                Has no effect with REFC_H_DEFERRED, which never recurses.
+ * REFC_H_EPOCH - keep blocks whose reference count reaches 0 allocated until
+ *                no thread is in an epoch that began before, so that
+ *                references can be borrowed without retaining them, see
+ *                `refc_epoch_enter`. Requires pthreads.
+ * REFC_H_SCOPE - let functions borrow references for the duration of a scope
+ *                without changing their reference counts, see
+ *                `refc_scope_enter`. Requires pthreads.
+ * REFC_H_STATS - count allocations, references and the time spent in
+ *                destructors on each thread, see `refc_stats_get`. Adds the
+ *                size of a block to the header. Requires pthreads.
+ * REFC_H_PROFILE - sample allocations and attribute them to tags set by
+ *                the allocating thread, see `refc_profile_report`. Blocks
+ *                are sampled about every REFC_H_PROFILE_RATE bytes, 512 KiB
+ *                unless defined otherwise.
+ * REFC_H_WEAK  - support weak references, see `refc_weak_create`. Adds a
+ *                pointer to the header.
+ * REFC_H_COMPACT - use a 32-bit reference count. Blocks are aligned to
+ *                8 bytes unless REFC_H_ALIGN says otherwise, making the
+ *                header 8 bytes.
+ * REFC_H_ALIGN - the alignment of blocks returned by refc_access.
+ *                Defaults to, and cannot exceed, _Alignof(max_align_t).
+ * REFC_H_SHARDED - support blocks whose reference count is split into
+ *                per-thread shards, see REFC_ALLOCATE_SHARDED. Cannot be
+ *                combined with REFC_H_SINGLE_THREADED, REFC_H_BIASED or
+ *                REFC_H_COLLECT.
+ * REFC_H_COUNT_SHARDS - the number of shards of such blocks. Defaults to 32.
+ * REFC_H_CACHE_LINE - the size of the cache lines that blocks allocated
+ *                with REFC_ALLOCATE_PADDED are padded to, and of the shards
+ *                of sharded blocks. Defaults to 64.
+ * REFC_H_MAX_TYPES - the number of types that can be registered, including
+ *                one for each distinct destructor passed to the allocation
+ *                functions. Defaults to 1024, at most 65535. Allocations
+ *                fail once the table of types is full.
+ * REFC_H_ARENA_CHUNK_SIZE - the size of the chunks that arenas allocate
+ *                blocks from, see `refc_arena_create`. Defaults to 64 KiB.
+ * REFC_H_INTERN_SHARDS - the number of independently locked parts of the
+ *                table of interned strings, see `refc_intern`. Defaults to 64.
  */
 
 #ifndef REFC_H
@@ -36,6 +106,10 @@
 
 #include <stddef.h>
 
+#ifndef REFC_H_SINGLE_THREADED
+#include <stdatomic.h>
+#endif
+
 /* Incomplete type for opaque pointer purpose */
 struct refc_ref;
 
@@ -49,9 +123,139 @@ struct refc_ref *refc_allocate(size_t size);
  */
 struct refc_ref *refc_allocate_dtor(size_t size, void (*destructor)(void *));
 
+/* Identifies a type registered with `refc_register_type`. 0 is no type. */
+typedef unsigned int refc_type_id;
+
+/*
+ * Registers a type of blocks with a given size and destructor.
+ * The destructor can be NULL. The name is kept for diagnostics and
+ * must outlive the program's use of the type, it can be NULL.
+ *
+ * Returns 0 if no more types can be registered.
+ */
+refc_type_id refc_register_type(void (*destructor)(void *), size_t size, const char *name);
+
+/*
+ * Allocate a reference-counted block of a registered type.
+ * Returns NULL if the type is 0 or was not registered.
+ */
+struct refc_ref *refc_allocate_typed(refc_type_id type);
+
+/*
+ * Returns the type of a block. Blocks allocated without a type
+ * have a type per destructor, these have no name and a size of 0.
+ */
+refc_type_id refc_type_of(struct refc_ref *ref);
+
+/* Returns the name of a type, NULL if it has none. */
+const char *refc_type_name(refc_type_id type);
+
+/*
+ * A memory allocator for reference-counted blocks.
+ *
+ * `allocate` must return memory aligned for any object type, or NULL.
+ * `free` receives pointers previously returned by `allocate`.
+ * `context` is passed as the first argument to both functions.
+ *
+ * An allocator must outlive all blocks that were allocated through it.
+ */
+struct refc_allocator {
+	void *(*allocate)(void *context, size_t size);
+	void (*free)(void *context, void *ptr);
+	void *context;
+};
+
+/*
+ * Sets the allocator used by `refc_allocate` and `refc_allocate_dtor`.
+ * Passing NULL restores the built-in allocator.
+ *
+ * Blocks are always freed through the allocator they were allocated with,
+ * so the allocator can be changed while blocks are still alive.
+ */
+void refc_set_allocator(const struct refc_allocator *allocator);
+
+/*
+ * Same as `refc_allocate_dtor` but allocates the block through
+ * the given allocator. Passing NULL selects the built-in allocator.
+ */
+struct refc_ref *refc_allocate_ex(size_t size, void (*destructor)(void *),
+		const struct refc_allocator *allocator);
+
+/* Flags for `refc_allocate_flags` */
+enum refc_allocate_flag {
+	/*
+	 * Put the header of the block on a cache line of its own and pad the
+	 * block to whole cache lines, so that retaining and releasing the
+	 * block on one thread does not slow down the threads reading it.
+	 * Such blocks are allocated with aligned_alloc, not the allocator set
+	 * with `refc_set_allocator`. With a REFC_H_ALIGN below the alignment
+	 * of the header the block starts a few bytes into its first line,
+	 * after the last fields of the header.
+	 */
+	REFC_ALLOCATE_PADDED = 1,
+
+#ifdef REFC_H_SHARDED
+	/*
+	 * Count the references of the block in shards on cache lines of their
+	 * own, so that threads retaining and releasing it only contend with
+	 * the threads that share their shard. Meant for a few blocks that all
+	 * threads reference all the time, each costs REFC_H_COUNT_SHARDS
+	 * cache lines more.
+	 *
+	 * The block cannot be disposed of until `refc_unshard` is called for
+	 * it, from then on it is counted like any other block.
+	 */
+	REFC_ALLOCATE_SHARDED = 2
+#endif
+};
+
+/*
+ * Same as `refc_allocate_dtor` but with a set of enum refc_allocate_flag.
+ */
+struct refc_ref *refc_allocate_flags(size_t size, void (*destructor)(void *), unsigned int flags);
+
+#ifdef REFC_H_SHARDED
+/*
+ * Folds the shards of a block allocated with REFC_ALLOCATE_SHARDED into
+ * one reference count, after which releasing its last reference disposes
+ * of it. The caller must own a reference, usually the one it is about to
+ * release, such as the reference of a table that replaces the block.
+ * Does nothing for other blocks and for blocks that were unsharded.
+ */
+void refc_unshard(struct refc_ref *ref);
+#endif
+
+/*
+ * An arena of reference-counted blocks that is freed all at once.
+ *
+ * Blocks allocated from an arena have their destructor called upon
+ * reaching a reference count of 0 but their memory is only returned
+ * by `refc_arena_destroy`. Allocating from the same arena is not
+ * thread-safe, retaining and releasing its blocks is.
+ */
+struct refc_arena;
+
+/* Creates an empty arena. Returns NULL on failure. */
+struct refc_arena *refc_arena_create(void);
+
+/*
+ * Same as `refc_allocate_dtor` but allocates the block from the arena.
+ */
+struct refc_ref *refc_arena_allocate(struct refc_arena *arena, size_t size,
+		void (*destructor)(void *));
+
+/*
+ * Frees the arena and the memory of all blocks allocated from it.
+ * Destructors of blocks that are still referenced are not called.
+ */
+void refc_arena_destroy(struct refc_arena *arena);
+
 /* Increase the reference count of the target block by one. */
 void refc_retain(struct refc_ref *ref);
 
+/* Increase the reference count of the target block by `n`. */
+void refc_retain_n(struct refc_ref *ref, size_t n);
+
 /*
  * Decrement the reference count of the target block by one.
  *
@@ -60,21 +264,307 @@ void refc_retain(struct refc_ref *ref);
  */
 void refc_release(struct refc_ref *ref);
 
+/* Decrement the reference count of the target block by `n`. */
+void refc_release_n(struct refc_ref *ref, size_t n);
+
+/*
+ * Decrement the reference count of each block in `refs` by one.
+ *
+ * Blocks that reach a reference count of 0 are collected and have their
+ * destructors called together before they are all freed together.
+ */
+void refc_release_array(struct refc_ref **refs, size_t count);
+
+#ifdef REFC_H_DEFERRED
+/*
+ * Calls the destructors of and frees up to `budget` blocks that reached
+ * a reference count of 0, in no particular order. Blocks released by
+ * those destructors are queued and can be disposed of by the same call.
+ * Can be called from any thread, including one dedicated to it.
+ *
+ * Returns the number of disposed blocks.
+ */
+size_t refc_drain(size_t budget);
+#endif
+
+#ifdef REFC_H_EPOCH
+/*
+ * Enters an epoch on the calling thread, epochs can be nested.
+ *
+ * A block that is referenced at any point after entering is not
+ * destructed or freed before the matching `refc_epoch_exit`, so it can
+ * be used without retaining it. Retaining it is still required to keep
+ * it past the epoch.
+ *
+ * Returns 0 if the thread could not be registered, in which case
+ * nothing is guaranteed and `refc_epoch_exit` must not be called.
+ */
+int refc_epoch_enter(void);
+
+/* Exits an epoch entered with `refc_epoch_enter`. */
+void refc_epoch_exit(void);
+
+/*
+ * Waits until all blocks that reached a reference count of 0 before
+ * the call are disposed of, including the blocks their destructors
+ * release. Must not be called inside an epoch.
+ */
+void refc_epoch_synchronize(void);
+#endif
+
+#ifdef REFC_H_SCOPE
+/* The start of a scope in the references borrowed by a thread */
+typedef size_t refc_scope;
+
+/*
+ * Opens a scope on the calling thread. Scopes can be nested
+ * and must be exited in the reverse order.
+ */
+refc_scope refc_scope_enter(void);
+
+/*
+ * Borrows a reference that the caller does not own until the innermost
+ * scope is exited, without changing its reference count. A block whose
+ * last reference is released on the calling thread in the meantime is
+ * kept alive until the outermost scope that borrowed it is exited.
+ * Releases on other threads are not held back.
+ *
+ * Returns 0 if the reference could not be recorded,
+ * in which case it is not borrowed.
+ */
+int refc_scope_borrow(struct refc_ref *ref);
+
+/* Exits a scope, releasing the blocks it kept alive. */
+void refc_scope_exit(refc_scope scope);
+#endif
+
+#ifdef REFC_H_STATS
+/*
+ * Totals of the counters kept by each thread, see `refc_stats_get`.
+ * Sizes are the sizes requested for blocks, without their headers.
+ */
+struct refc_stats {
+	/* Blocks allocated and freed */
+	size_t allocations;
+	size_t frees;
+
+	/* Blocks that are allocated and not yet freed, and their sizes */
+	size_t live_blocks;
+	size_t live_bytes;
+
+	/* References added and removed */
+	size_t retains;
+	size_t releases;
+
+	/* Time spent in destructors, in nanoseconds */
+	unsigned long long destructor_ns;
+};
+
+/*
+ * Adds up the counters of all threads, including the threads that exited.
+ * The counters of other threads are read while they change, so the totals
+ * are only exact when no other thread uses the library.
+ */
+struct refc_stats refc_stats_get(void);
+#endif
+
+#ifdef REFC_H_PROFILE
+/*
+ * Sets the tag that the calling thread's allocations are attributed to,
+ * NULL for none. Tags are compared as strings and must outlive the blocks
+ * allocated with them. Returns the previous tag.
+ */
+const char *refc_profile_tag(const char *tag);
+
+/* Sets the number of bytes allocated between samples, 0 stops sampling. */
+void refc_profile_set_rate(size_t bytes);
+
+/* The live sampled blocks of a tag */
+struct refc_profile_site {
+	const char *tag;
+
+	/* Sampled blocks that are not yet freed, and their sizes */
+	size_t blocks;
+	size_t bytes;
+
+	/* Bytes of the whole allocations that the samples stand for */
+	size_t estimated_bytes;
+};
+
+/*
+ * Calls `report` for each tag of the sampled blocks that are not yet freed.
+ * Blocks sampled under a different rate are estimated with the current one.
+ *
+ * Returns 0 on failure, in which case `report` is not called.
+ */
+int refc_profile_report(void (*report)(void *context, const struct refc_profile_site *site),
+		void *context);
+#endif
+
 /* Returns the target block of this reference */
 void *refc_access(struct refc_ref *ref);
 
+/*
+ * A reference count that is embedded in a user-defined structure,
+ * for objects whose memory is not allocated by this library.
+ *
+ * Initialize it with `refc_init` and use `refc_header_retain` and
+ * `refc_header_release` instead of `refc_retain` and `refc_release`.
+ * Upon reaching a reference count of 0 the release callback receives
+ * the header and is responsible for destroying the enclosing object.
+ */
+struct refc_header {
+#ifdef REFC_H_SINGLE_THREADED
+	size_t reference_count;
+#else
+	atomic_size_t reference_count;
+#endif
+	void (*release)(struct refc_header *header);
+};
+
+/* Initialize an embedded header with a reference count of 1. */
+void refc_init(struct refc_header *header, void (*release)(struct refc_header *header));
+
+/* Increase the reference count of an embedded header by one. */
+void refc_header_retain(struct refc_header *header);
+
+/*
+ * Decrement the reference count of an embedded header by one,
+ * calling its release callback upon reaching a reference count of 0.
+ */
+void refc_header_release(struct refc_header *header);
+
+/*
+ * Reference-counted byte buffers are blocks whose bytes are reached
+ * through `refc_buf_data` instead of `refc_access`. They are retained
+ * and released like any other block.
+ */
+
+/* Allocate a buffer of `length` bytes with a reference count of 1. */
+struct refc_ref *refc_buf_allocate(size_t length);
+
+/*
+ * Wrap memory owned by the caller in a buffer with a reference count of 1.
+ * Upon reaching a reference count of 0 `release` is called (if not NULL)
+ * with `context` and the wrapped memory.
+ *
+ * Returns NULL on failure, in which case `release` is not called.
+ */
+struct refc_ref *refc_buf_wrap(void *data, size_t length,
+		void (*release)(void *context, void *data, size_t length), void *context);
+
+/*
+ * Create a buffer of `length` bytes at `offset` within another buffer
+ * without copying them. The slice keeps the memory of the buffer alive,
+ * the caller keeps its own reference to `buf`.
+ *
+ * Returns NULL if the range is out of bounds or on failure.
+ */
+struct refc_ref *refc_buf_slice(struct refc_ref *buf, size_t offset, size_t length);
+
+/* Returns the first byte of a buffer */
+void *refc_buf_data(struct refc_ref *buf);
+
+/* Returns the length of a buffer in bytes */
+size_t refc_buf_length(struct refc_ref *buf);
+
+/*
+ * A slot holding a reference that threads can load and replace
+ * concurrently. A zero-initialized slot is valid and holds NULL.
+ *
+ * Loading waits for nothing. Replacing waits until the threads that may
+ * have loaded the previous reference have retained it, so that it can
+ * be released right away.
+ */
+struct refc_atomic_slot {
+#ifdef REFC_H_SINGLE_THREADED
+	struct refc_ref *ref;
+#else
+	struct refc_ref * _Atomic ref;
+
+	/* Threads loading the reference in each phase */
+	atomic_size_t readers[2];
+	atomic_uint phase;
+
+	/* Held by the thread replacing the reference */
+	atomic_bool lock;
+#endif
+};
+
+/* Returns the reference in the slot retained, or NULL if it is empty. */
+struct refc_ref *refc_atomic_slot_load_retain(struct refc_atomic_slot *slot);
+
+/*
+ * Puts a reference owned by the caller in the slot, which can be NULL.
+ * Returns the previous reference, which is now owned by the caller.
+ */
+struct refc_ref *refc_atomic_slot_exchange(struct refc_atomic_slot *slot, struct refc_ref *ref);
+
+/* Same as `refc_atomic_slot_exchange` but releases the previous reference. */
+void refc_atomic_slot_store(struct refc_atomic_slot *slot, struct refc_ref *ref);
+
+/*
+ * Returns a block holding a copy of `length` bytes followed by a 0 byte,
+ * retaining the block already interned for the same bytes if there is
+ * one. Interned blocks are equal if and only if their bytes are equal.
+ * A block leaves the table when its reference count reaches 0.
+ *
+ * Returns NULL on failure.
+ */
+struct refc_ref *refc_intern(const void *bytes, size_t length);
+
+/* Returns the bytes of an interned block */
+const char *refc_intern_data(struct refc_ref *ref);
+
+/* Returns the length of an interned block, without the 0 byte */
+size_t refc_intern_length(struct refc_ref *ref);
+
+#ifdef REFC_H_WEAK
+/*
+ * A weak reference to a block, which does not keep it alive.
+ *
+ * A block is destructed and freed once its reference count reaches 0,
+ * only the small control block of its weak references stays allocated
+ * until all of them are released. Arena blocks with weak references
+ * must be released before their arena is destroyed.
+ */
+struct refc_weak_ref;
+
+/*
+ * Creates a weak reference to a block that the caller owns.
+ * Weak references to the same block share a control block.
+ *
+ * Returns NULL on failure.
+ */
+struct refc_weak_ref *refc_weak_create(struct refc_ref *ref);
+
+/*
+ * Retains the target of a weak reference.
+ *
+ * Returns a reference that the caller owns,
+ * or NULL if the block has no references left.
+ */
+struct refc_ref *refc_weak_lock(struct refc_weak_ref *weak);
+
+/* Releases a weak reference. */
+void refc_weak_release(struct refc_weak_ref *weak);
+#endif
+
 /*
  * Links two references into a parent-child relation.
- * Used to track reference cycles when REFC_H_DEBUG is defined.
- * Does nothing when REFC_H_DEBUG is not defined.
+ * Used to track reference cycles when REFC_H_DEBUG is defined
+ * and to collect them when REFC_H_COLLECT is defined.
+ * Does nothing when neither is defined.
  *
  * Returns 1 if the link is successful.
  * Returns 0 if a cycle is found or the link cannot be established.
+ * Cycles are only checked for when REFC_H_DEBUG is defined without
+ * REFC_H_COLLECT, which reclaims them instead.
  * This makes it suitable to be used in an assert macro.
  *
- * When REFC_H_DEBUG is not defined refc_link is a macro for (1).
+ * When neither is defined refc_link is a macro for (1).
  */
-#ifdef REFC_H_DEBUG
+#if defined(REFC_H_DEBUG) || defined(REFC_H_COLLECT)
 int refc_link(struct refc_ref *parent, struct refc_ref *child);
 #else
 #define refc_link(P, C) (1)
@@ -82,19 +572,53 @@ int refc_link(struct refc_ref *parent, struct refc_ref *child);
 
 /*
  * Unlinks two references from a parent-child relation.
- * Used to track reference cycles when REFC_H_DEBUG is defined.
+ * Used to track reference cycles when REFC_H_DEBUG or REFC_H_COLLECT
+ * is defined.
  *
  * Returns 1 when the unlinking is successful.
  * Returns 0 when there is no such link.
  *
- * When REFC_H_DEBUG is not defined refc_unlink is an empty macro.
+ * When neither is defined refc_unlink is an empty macro.
  */
-#ifdef REFC_H_DEBUG
+#if defined(REFC_H_DEBUG) || defined(REFC_H_COLLECT)
 int refc_unlink(struct refc_ref *parent, struct refc_ref *child);
 #else
 #define refc_unlink(P, C)
 #endif
 
+#ifdef REFC_H_DEBUG
+/* Returns the number of blocks that are not yet freed, except arena blocks. */
+size_t refc_debug_live(void);
+
+/*
+ * Writes the blocks that are not yet freed to stderr, except arena blocks,
+ * with their sizes, reference counts, types, destructors and child links.
+ * Returns the number of blocks written.
+ */
+size_t refc_debug_report(void);
+
+/* Calls `refc_debug_report` when the program exits. Returns 0 on failure. */
+int refc_debug_report_at_exit(void);
+#endif
+
+#ifdef REFC_H_COLLECT
+/*
+ * Reclaims blocks that are only referenced by cycles of links.
+ *
+ * Each link must stand for a reference that the parent holds to the
+ * child and that its destructor releases. Blocks that were released
+ * without reaching a reference count of 0 are checked by trial deletion,
+ * following the links of blocks they reach. The destructors of all
+ * collected blocks are called before any of them is freed.
+ *
+ * No other thread can retain, release or link blocks during the call.
+ * Must not be called inside an epoch.
+ *
+ * Returns the number of reclaimed blocks.
+ */
+size_t refc_collect(void);
+#endif
+
 #endif /* REFC_H */
 
 #ifdef REFC_H_IMPLEMENTATION
@@ -102,141 +626,3144 @@ int refc_unlink(struct refc_ref *parent, struct refc_ref *child);
 
 #include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
-#ifdef REFC_H_DEBUG
-struct ListNode {
-	struct ListNode *next;
-	struct refc_ref * _Atomic value;
-};
+#ifdef REFC_H_POOL
+/*
+ * Pooled blocks are grouped in power-of-two size classes by payload size,
+ * from REFC_POOL_MIN_SIZE up to REFC_POOL_MIN_SIZE << (REFC_POOL_CLASSES - 1).
+ * Larger payloads are served by malloc as usual.
+ */
+#define REFC_POOL_MIN_SIZE 16
+#define REFC_POOL_CLASSES 8
+
+/* Size of the chunks that are carved into blocks of a single size class */
+#ifndef REFC_H_POOL_SLAB_SIZE
+#define REFC_H_POOL_SLAB_SIZE (64 * 1024)
 #endif
 
-struct refc_ref {
-	/* The reference count for this reference */
-	atomic_size_t reference_count;
+/* Number of free blocks per size class that a thread keeps to itself */
+#ifndef REFC_H_POOL_CACHE_SIZE
+#define REFC_H_POOL_CACHE_SIZE 64
+#endif
+#endif
 
-	/* Associated destructor function. Can be NULL */
-	void (*destructor)(void *);
+/* Size of the chunks that an arena allocates blocks from */
+#ifndef REFC_H_ARENA_CHUNK_SIZE
+#define REFC_H_ARENA_CHUNK_SIZE (64 * 1024)
+#endif
 
-#ifdef REFC_H_DEBUG
-	/* Contains child links */
-	struct ListNode * _Atomic links;
+#ifndef REFC_H_CACHE_LINE
+#define REFC_H_CACHE_LINE 64
 #endif
 
-	/* The memory block returned by refc_access */
-	_Alignas(max_align_t) unsigned char block[];
-};
+#ifndef REFC_H_COUNT_SHARDS
+#define REFC_H_COUNT_SHARDS 32
+#endif
 
-struct refc_ref *refc_allocate(size_t size) {
-	return refc_allocate_dtor(size, NULL);
-}
+#ifndef REFC_H_ALIGN
+#ifdef REFC_H_COMPACT
+#define REFC_H_ALIGN 8
+#else
+#define REFC_H_ALIGN _Alignof(max_align_t)
+#endif
+#endif
 
-struct refc_ref *refc_allocate_dtor(size_t size, void (*destructor)(void *)) {
-	struct refc_ref *ref = malloc(sizeof(struct refc_ref) + size);
-	if (ref == NULL) {
-		return NULL;
-	}
-	ref->reference_count = 1;
-	ref->destructor = destructor;
+/* malloc, arena chunks and pool slabs are only aligned for max_align_t */
+_Static_assert(REFC_H_ALIGN <= _Alignof(max_align_t), "REFC_H_ALIGN cannot exceed _Alignof(max_align_t)");
 
-#ifdef REFC_H_DEBUG
-    ref->links = NULL;
+/* Number of independently locked parts of the interning table */
+#ifndef REFC_H_INTERN_SHARDS
+#define REFC_H_INTERN_SHARDS 64
 #endif
 
-	return ref;
-}
+#ifndef REFC_H_MAX_TYPES
+#define REFC_H_MAX_TYPES 1024
+#endif
 
-void refc_retain(struct refc_ref *ref) {
-	atomic_fetch_add_explicit(&(ref->reference_count), 1, memory_order_relaxed);
-}
+#ifndef REFC_H_PROFILE_RATE
+#define REFC_H_PROFILE_RATE (512 * 1024)
+#endif
 
-void refc_release(struct refc_ref *ref) {
-	atomic_fetch_sub_explicit(&(ref->reference_count), 1, memory_order_relaxed);
-	if (atomic_load_explicit(&(ref->reference_count), memory_order_relaxed) > 0) {
-		return;
-	}
-	if (ref->destructor != NULL) {
-		(ref->destructor)(&ref->block);
-	}
-#ifdef REFC_H_DEBUG
-    struct ListNode *head = atomic_load(&(ref->links));
-    struct ListNode *next;
-    while (head) {
-        next = head->next;
-        free(head);
-        head = next;
-    }
+#if defined(REFC_H_SINGLE_THREADED) && defined(REFC_H_BIASED)
+#error "REFC_H_SINGLE_THREADED and REFC_H_BIASED are mutually exclusive"
 #endif
-	free(ref);
-}
 
-void *refc_access(struct refc_ref *ref) {
-	return &ref->block;
-}
+#if defined(REFC_H_COLLECT) && defined(REFC_H_BIASED)
+#error "REFC_H_COLLECT and REFC_H_BIASED are mutually exclusive"
+#endif
 
-#ifdef REFC_H_DEBUG
-int find_in_lists(struct ListNode *head, struct refc_ref *match) {
-    while(head) {
-        struct refc_ref *value = atomic_load(&(head->value));
-        if (value == match) {
-            return 1;
-        }
-        if (find_in_lists(atomic_load(&(value->links)), match)) {
-            return 1;
-        }
-        head = head->next;
-    }
-    return 0;
-}
+#if defined(REFC_H_SHARDED) && (defined(REFC_H_SINGLE_THREADED) || defined(REFC_H_BIASED) \
+	|| defined(REFC_H_COLLECT))
+#error "REFC_H_SHARDED cannot be combined with REFC_H_SINGLE_THREADED, REFC_H_BIASED or REFC_H_COLLECT"
+#endif
 
-int refc_link(struct refc_ref *parent, struct refc_ref *child) {
-    /*
-     * Check the list of links for a cycle
-     */
-	struct ListNode *head = atomic_load(&(child->links));
-	if (find_in_lists(head, parent)) {
-        return 0;
-    }
+/* Features that keep lists of unreferenced blocks */
+#if defined(REFC_H_DEFERRED) || defined(REFC_H_ITERATIVE) || defined(REFC_H_EPOCH)
+#define REFC_DISPOSE_LIST
+#endif
 
-    /*
-     * Check for linking attempt between the same block
-     */
-    if (parent == child) {
-        return 0;
-    }
+/* Features that keep the links made with refc_link */
+#if defined(REFC_H_DEBUG) || defined(REFC_H_COLLECT)
+#define REFC_LINKS
+#endif
 
-    /*
-     * No cycles found, append the child to the parent's list of links
-     */
-    struct ListNode *new_head = malloc(sizeof(struct ListNode));
-    if (new_head == NULL) {
-        return 0;
-    }
-    atomic_store(&(new_head->value), child);
-    do {
-        head = (struct ListNode *) atomic_load(&parent->links);
-        new_head->next = head;
-    } while (!atomic_compare_exchange_weak(&(parent->links), &head, new_head));
-	return 1;
-}
+/* Links that would close a cycle are rejected unless cycles are collected */
+#if defined(REFC_H_DEBUG) && !defined(REFC_H_COLLECT)
+#define REFC_CYCLE_CHECK
+#endif
 
-int refc_unlink(struct refc_ref *parent, struct refc_ref *child) {
+/* Features that keep the size of blocks */
+#if defined(REFC_H_STATS) || defined(REFC_H_DEBUG)
+#define REFC_BLOCK_SIZE
+#endif
+
+/* Features that keep per-thread state */
+#if defined(REFC_H_POOL) || defined(REFC_H_BIASED) || defined(REFC_H_EPOCH) || defined(REFC_H_SCOPE) \
+	|| defined(REFC_H_STATS)
+#define REFC_THREAD_STATE
+#include <pthread.h>
+#endif
+
+#ifdef REFC_H_COMPACT
+typedef uint_least32_t refc_count_value;
+#else
+typedef size_t refc_count_value;
+#endif
+
+#ifdef REFC_H_SINGLE_THREADED
+typedef refc_count_value refc_count;
+#else
+typedef _Atomic(refc_count_value) refc_count;
+#endif
+
+struct refc_type {
+	/* Called upon reaching a reference count of 0. Can be NULL */
+	void (*destructor)(void *);
+
+	/* Size of the blocks of this type, 0 for types of a destructor */
+	size_t size;
+
+	/* Name for diagnostics. Can be NULL */
+	const char *name;
+
+#ifdef REFC_H_POOL
+	/* Size class of the blocks of this type */
+	unsigned char size_class;
+#endif
+};
+
+#ifdef REFC_H_DEBUG
+#include <stdio.h>
+#endif
+
+#if defined(REFC_H_SINGLE_THREADED) && defined(REFC_H_DEBUG)
+#include <assert.h>
+
+/* The address of this variable identifies the calling thread */
+static _Thread_local char refc_thread_id;
+#endif
+
+#ifdef REFC_LINKS
+/* A growable array of linked blocks, in no particular order */
+struct refc_links {
+	size_t count;
+	size_t capacity;
+	struct refc_ref *refs[];
+};
+#endif
+
+#ifdef REFC_H_COLLECT
+enum refc_collect_flag {
+	/* Set once the block has been linked */
+	REFC_COLLECT_LINKED = 1,
+
+	/* Set while the block is in refc_roots */
+	REFC_COLLECT_BUFFERED = 2,
+
+	/* Set while the block is reclaimed by refc_collect */
+	REFC_COLLECT_RECLAIMED = 4
+};
+
+/* States of blocks in refc_collect */
+enum refc_color {
+	/* In use or not yet visited */
+	REFC_BLACK,
+
+	/* Visited while removing the references of links */
+	REFC_GRAY,
+
+	/* Only referenced by links */
+	REFC_WHITE,
+
+	/* Possible root of a garbage cycle */
+	REFC_PURPLE
+};
+#endif
+
+/* Where the memory of a block comes from */
+enum refc_backend {
+	/* Allocated with malloc */
+	REFC_BACKEND_MALLOC,
+
+	/* Allocated from the pool of its size class */
+	REFC_BACKEND_POOL,
+
+	/* Allocated through a struct refc_allocator kept in a struct refc_prefix */
+	REFC_BACKEND_ALLOCATOR,
+
+	/* Allocated from a struct refc_arena, never freed on its own */
+	REFC_BACKEND_ARENA,
+
+	/* Allocated with aligned_alloc behind REFC_PADDED_HEADER + REFC_PADDED_SKEW bytes */
+	REFC_BACKEND_PADDED,
+};
+
+#ifdef REFC_H_BIASED
+/*
+ * The shared count of a biased reference holds the count of references
+ * from non-owning threads multiplied by REFC_BIASED_ONE, which can be
+ * negative, combined with the following flags.
+ */
+#define REFC_BIASED_ONE 4
+
+/* The biased count has been folded into the shared count */
+#define REFC_BIASED_MERGED 1
+
+/* The shared count went negative and the ref is queued for its owner */
+#define REFC_BIASED_QUEUED 2
+#endif
+
+#ifdef REFC_H_SHARDED
+/* References added on a shard less those released on it, can be negative */
+struct refc_count_shard {
+	_Alignas(REFC_H_CACHE_LINE) atomic_intptr_t count;
+};
+
+/*
+ * The count of a shard whose references were added to the block's count.
+ * Additions that race with the fold still land on the shard, any count
+ * below REFC_SHARD_FOLDED / 2 means that the shard was folded.
+ */
+#define REFC_SHARD_FOLDED (INTPTR_MIN / 2)
+
+/*
+ * Added to the reference count while the shards are folded into it, so
+ * that releases of references whose shards were folded already do not
+ * take it to 0 before the sum of the other shards is added.
+ */
+#define REFC_SHARD_BIAS (((refc_count_value) -1 >> 2) + 1)
+
+/*
+ * The shards of a sharded block. Until they are folded the reference
+ * count holds the allocation reference, which keeps the block alive no
+ * matter how the references are spread over the shards.
+ */
+struct refc_shards {
+	struct refc_count_shard shard[REFC_H_COUNT_SHARDS];
+
+	/* Set by the first refc_unshard */
+	atomic_bool folded;
+};
+#endif
+
+struct refc_ref {
+#ifdef REFC_H_BIASED
+	/* The thread owning the biased count */
+	struct refc_thread *owner;
+
+	/* References held by the owning thread, only accessed by it. 0 once merged */
+	size_t biased_count;
+
+	/* References held by other threads, see REFC_BIASED_ONE */
+	atomic_intptr_t shared_count;
+
+	/* Next ref in the queue of the owning thread */
+	struct refc_ref *biased_next;
+#else
+	/* The reference count for this reference */
+	refc_count reference_count;
+#endif
+
+#ifdef REFC_H_SHARDED
+	/* Shards of the reference count, NULL unless allocated as sharded */
+	struct refc_shards *shards;
+#endif
+
+	/* The type of this reference, 0 for no destructor */
+	uint16_t type;
+
+#ifdef REFC_BLOCK_SIZE
+	/* The requested size of the block */
+	size_t size;
+#endif
+
+	/* One of enum refc_backend */
+	unsigned char backend;
+
+#ifdef REFC_H_PROFILE
+	/* Set if the block is in refc_profile_samples */
+	unsigned char sampled;
+#endif
+
+#ifdef REFC_H_POOL
+	/* Size class of a pooled block */
+	unsigned char size_class;
+
+	/* Thread that allocated a pooled block, NULL if none */
+	struct refc_thread *pool_owner;
+#endif
+
+#ifdef REFC_DISPOSE_LIST
+	/* Next block in a list of blocks waiting to be disposed of */
+	struct refc_ref *dispose_next;
+#endif
+
+#ifdef REFC_H_WEAK
+	/* Control block of the weak references to this block, NULL if none */
+	struct refc_weak_ref * _Atomic weak;
+#endif
+
+#ifdef REFC_LINKS
+	/* Contains child links */
+	struct refc_links *links;
+
+	/* Contains parent links, the reverse of the child links */
+	struct refc_links *parents;
+#endif
+
+#ifdef REFC_H_COLLECT
+	/* Set of enum refc_collect_flag */
+	atomic_uchar collect_flags;
+
+	/* One of enum refc_color, used by refc_collect */
+	unsigned char color;
+
+	/* Position in refc_roots while buffered */
+	size_t root;
+
+	/* Next block on the stacks of refc_collect */
+	struct refc_ref *collect_next;
+	struct refc_ref *collect_black_next;
+#endif
+
+#ifdef REFC_H_DEBUG
+	/* Neighbours in the shard of refc_debug_shards that holds the block */
+	struct refc_ref *live_prev;
+	struct refc_ref *live_next;
+#endif
+
+#ifdef REFC_CYCLE_CHECK
+	/* Position in the topological order of linked blocks, 0 if unlinked */
+	int64_t order;
+
+	/* The last search that reached this block, see refc_visit */
+	size_t visited;
+#endif
+
+#if defined(REFC_H_SINGLE_THREADED) && defined(REFC_H_DEBUG)
+	/* The thread that is allowed to change the reference count */
+	const char *thread;
+#endif
+
+	/* The memory block returned by refc_access */
+	_Alignas(REFC_H_ALIGN) unsigned char block[];
+};
+
+/*
+ * Blocks from a custom allocator are preceded by the allocator itself,
+ * so that only those blocks pay for storing it.
+ */
+struct refc_prefix {
+	const struct refc_allocator *allocator;
+
+	/* The struct refc_ref that follows */
+	_Alignas(struct refc_ref) unsigned char ref[];
+};
+
+static struct refc_prefix *refc_get_prefix(struct refc_ref *ref) {
+	return (struct refc_prefix *) ((unsigned char *) ref - offsetof(struct refc_prefix, ref));
+}
+
+/* Returns the reference of a block returned by refc_access */
+static struct refc_ref *refc_get_ref(void *block) {
+	return (struct refc_ref *) ((unsigned char *) block - offsetof(struct refc_ref, block));
+}
+
+/*
+ * Blocks are only aligned to REFC_H_ALIGN, so structs of this library that
+ * need more are placed at the first aligned address within their block,
+ * which takes up to REFC_INTERNAL_SLACK bytes more.
+ */
+#define REFC_INTERNAL_SLACK(type) \
+	(_Alignof(type) > REFC_H_ALIGN ? _Alignof(type) - REFC_H_ALIGN : 0)
+
+static void *refc_internal(struct refc_ref *ref, size_t align) {
+	uintptr_t address = (uintptr_t) refc_access(ref);
+	return (void *) ((address + align - 1) & ~(uintptr_t) (align - 1));
+}
+
+/* The allocator used by refc_allocate and refc_allocate_dtor, NULL for built-in */
+static const struct refc_allocator * _Atomic refc_allocator;
+
+/*
+ * A minimal spinlock for the short critical sections in this file.
+ * Plain atomic_bool is used as it is valid when zero-initialized.
+ */
+static inline void refc_lock(atomic_bool *lock) {
+	while (atomic_exchange_explicit(lock, 1, memory_order_acquire)) {
+		while (atomic_load_explicit(lock, memory_order_relaxed)) {
+		}
+	}
+}
+
+static inline void refc_unlock(atomic_bool *lock) {
+	atomic_store_explicit(lock, 0, memory_order_release);
+}
+
+/*
+ * ThreadSanitizer does not model fences, under it the decrements of
+ * reference counts acquire instead of the fence after the last one.
+ */
+#if defined(__SANITIZE_THREAD__)
+#define REFC_TSAN
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define REFC_TSAN
+#endif
+#endif
+
+#ifdef REFC_TSAN
+#define REFC_DECREMENT_ORDER memory_order_acq_rel
+#else
+#define REFC_DECREMENT_ORDER memory_order_release
+#endif
+
+/* Makes the writes published by decrements visible after the last one */
+static inline void refc_acquire_fence(void) {
+#ifndef REFC_TSAN
+	atomic_thread_fence(memory_order_acquire);
+#endif
+}
+
+#ifdef REFC_H_POOL
+struct refc_pool_class {
+	/* Protects the free list */
+	atomic_bool lock;
+
+	/* Free blocks, linked through the first bytes of their payload */
+	struct refc_ref *free;
+};
+
+/* A thread-local free list of a single size class */
+struct refc_pool_cache {
+	struct refc_ref *free;
+	size_t count;
+};
+#endif
+
+#ifdef REFC_H_STATS
+#include <time.h>
+
+/* Counters of struct refc_stats that threads add to */
+enum refc_stat {
+	REFC_STAT_ALLOCATIONS,
+	REFC_STAT_FREES,
+	REFC_STAT_ALLOCATED_BYTES,
+	REFC_STAT_FREED_BYTES,
+	REFC_STAT_RETAINS,
+	REFC_STAT_RELEASES,
+	REFC_STAT_DESTRUCTOR_NS,
+	REFC_STATS
+};
+#endif
+
+#ifdef REFC_H_SCOPE
+/* A reference borrowed by a scope */
+struct refc_scope_entry {
+	struct refc_ref *ref;
+
+	/* Set once the scope holds the last reference to the block */
+	_Bool owned;
+};
+#endif
+
+#ifdef REFC_THREAD_STATE
+/*
+ * Per-thread state. Records are claimed by threads on first use and
+ * released for reuse when the thread exits. They are never freed so
+ * other threads can always reach a record through a pointer to it.
+ */
+struct refc_thread {
+	/* Next record in refc_threads */
+	struct refc_thread *next;
+
+	/* Set while the record is owned by a running thread */
+	atomic_bool in_use;
+
+#ifdef REFC_H_POOL
+	/* Free lists in front of refc_pool_classes */
+	struct refc_pool_cache pool_cache[REFC_POOL_CLASSES];
+
+	/* Blocks allocated by this thread and released by other threads */
+	struct refc_ref * _Atomic pool_remote;
+#endif
+
+#ifdef REFC_H_BIASED
+	/* Owned refs whose shared count went negative */
+	struct refc_ref * _Atomic biased_queue;
+#endif
+
+#ifdef REFC_H_EPOCH
+	/* The epoch this thread is in, 0 if none */
+	atomic_size_t epoch;
+
+	/* Nesting depth of refc_epoch_enter */
+	size_t epoch_depth;
+
+	/* Set while disposing of blocks reclaimed by an epoch change */
+	_Bool epoch_reclaiming;
+
+	/* The epoch of the last blocks this thread retired, 0 once reclaimed */
+	size_t epoch_retired;
+
+	/* Outermost exits, see REFC_EPOCH_ADVANCE_INTERVAL */
+	size_t epoch_exits;
+#endif
+
+#ifdef REFC_H_SCOPE
+	/* References borrowed by the open scopes, innermost last */
+	struct refc_scope_entry *scope_entries;
+	size_t scope_count;
+	size_t scope_capacity;
+
+	/*
+	 * The outermost entry of each borrowed block, plus one, in an
+	 * open-addressing hash table with twice scope_capacity slots
+	 */
+	size_t *scope_index;
+#endif
+
+#ifdef REFC_H_STATS
+	/* Only written by the owning thread, indexed by enum refc_stat */
+	atomic_ullong stats[REFC_STATS];
+#endif
+};
+
+static struct refc_thread * _Atomic refc_threads;
+static _Thread_local struct refc_thread *refc_thread_current;
+static pthread_once_t refc_thread_once = PTHREAD_ONCE_INIT;
+static pthread_key_t refc_thread_key;
+
+static void refc_thread_exit(void *data);
+
+static void refc_thread_init(void) {
+	pthread_key_create(&refc_thread_key, refc_thread_exit);
+}
+
+/*
+ * Returns the record of the calling thread, claiming one on first use.
+ * Returns NULL if no record is available and a new one cannot be allocated.
+ */
+static struct refc_thread *refc_thread_get(void) {
+	struct refc_thread *thread = refc_thread_current;
+	if (thread != NULL) {
+		return thread;
+	}
+	pthread_once(&refc_thread_once, refc_thread_init);
+
+	for (thread = atomic_load(&refc_threads); thread != NULL; thread = thread->next) {
+		_Bool in_use = 0;
+		if (atomic_compare_exchange_strong(&(thread->in_use), &in_use, 1)) {
+			break;
+		}
+	}
+	if (thread == NULL) {
+		thread = calloc(1, sizeof(struct refc_thread));
+		if (thread == NULL) {
+			return NULL;
+		}
+		atomic_init(&(thread->in_use), 1);
+#ifdef REFC_H_POOL
+		atomic_init(&(thread->pool_remote), NULL);
+#endif
+#ifdef REFC_H_BIASED
+		atomic_init(&(thread->biased_queue), NULL);
+#endif
+#ifdef REFC_H_EPOCH
+		atomic_init(&(thread->epoch), 0);
+#endif
+#ifdef REFC_H_STATS
+		for (int stat = 0; stat < REFC_STATS; stat++) {
+			atomic_init(&(thread->stats[stat]), 0);
+		}
+#endif
+		struct refc_thread *head = atomic_load(&refc_threads);
+		do {
+			thread->next = head;
+		} while (!atomic_compare_exchange_weak(&refc_threads, &head, thread));
+	}
+
+	pthread_setspecific(refc_thread_key, thread);
+	refc_thread_current = thread;
+	return thread;
+}
+#endif
+
+#ifdef REFC_H_STATS
+/* Counters of the threads that have no record */
+static atomic_ullong refc_stats_shared[REFC_STATS];
+
+/* Adds to a counter of the calling thread */
+static void refc_stats_add(enum refc_stat stat, unsigned long long n) {
+	struct refc_thread *thread = refc_thread_get();
+	if (thread == NULL) {
+		atomic_fetch_add_explicit(&refc_stats_shared[stat], n, memory_order_relaxed);
+		return;
+	}
+	/* Other threads only read the counter, it needs no atomic addition */
+	atomic_ullong *counter = &(thread->stats[stat]);
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+			memory_order_relaxed);
+}
+
+static unsigned long long refc_stats_now(void) {
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return (unsigned long long) now.tv_sec * 1000000000 + (unsigned long long) now.tv_nsec;
+}
+
+struct refc_stats refc_stats_get(void) {
+	unsigned long long totals[REFC_STATS];
+	for (int stat = 0; stat < REFC_STATS; stat++) {
+		totals[stat] = atomic_load_explicit(&refc_stats_shared[stat], memory_order_relaxed);
+	}
+	for (struct refc_thread *thread = atomic_load(&refc_threads); thread != NULL; thread = thread->next) {
+		for (int stat = 0; stat < REFC_STATS; stat++) {
+			totals[stat] += atomic_load_explicit(&(thread->stats[stat]), memory_order_relaxed);
+		}
+	}
+	struct refc_stats stats;
+	stats.allocations = (size_t) totals[REFC_STAT_ALLOCATIONS];
+	stats.frees = (size_t) totals[REFC_STAT_FREES];
+	/* A free can be counted before the allocation it matches is seen */
+	stats.live_blocks = stats.allocations > stats.frees ? stats.allocations - stats.frees : 0;
+	stats.live_bytes = totals[REFC_STAT_ALLOCATED_BYTES] > totals[REFC_STAT_FREED_BYTES]
+		? (size_t) (totals[REFC_STAT_ALLOCATED_BYTES] - totals[REFC_STAT_FREED_BYTES]) : 0;
+	stats.retains = (size_t) totals[REFC_STAT_RETAINS];
+	stats.releases = (size_t) totals[REFC_STAT_RELEASES];
+	stats.destructor_ns = totals[REFC_STAT_DESTRUCTOR_NS];
+	return stats;
+}
+#endif
+
+#ifdef REFC_H_PROFILE
+/* A sampled block that is not yet freed */
+struct refc_profile_sample {
+	struct refc_ref *ref;
+	const char *tag;
+	size_t size;
+
+	/* Next sample in the same bucket */
+	struct refc_profile_sample *next;
+};
+
+#define REFC_PROFILE_BUCKETS 1024
+
+/* Sampled blocks by address, guarded by refc_profile_lock */
+static struct refc_profile_sample *refc_profile_samples[REFC_PROFILE_BUCKETS];
+static atomic_bool refc_profile_lock;
+
+static atomic_size_t refc_profile_rate = REFC_H_PROFILE_RATE;
+
+/* Bytes the calling thread allocates before its next sample, 0 if not set */
+static _Thread_local size_t refc_profile_remaining;
+static _Thread_local const char *refc_profile_current;
+
+const char *refc_profile_tag(const char *tag) {
+	const char *previous = refc_profile_current;
+	refc_profile_current = tag;
+	return previous;
+}
+
+void refc_profile_set_rate(size_t bytes) {
+	atomic_store_explicit(&refc_profile_rate, bytes, memory_order_relaxed);
+	refc_profile_remaining = 0;
+}
+
+static size_t refc_profile_bucket(struct refc_ref *ref) {
+	return ((uintptr_t) ref / sizeof(struct refc_ref)) % REFC_PROFILE_BUCKETS;
+}
+
+/* Samples a new block once enough bytes were allocated since the last sample */
+static void refc_profile_allocated(struct refc_ref *ref, size_t size) {
+	ref->sampled = 0;
+	size_t rate = atomic_load_explicit(&refc_profile_rate, memory_order_relaxed);
+	if (rate == 0) {
+		return;
+	}
+	if (refc_profile_remaining == 0) {
+		refc_profile_remaining = rate;
+	}
+	if (size < refc_profile_remaining) {
+		refc_profile_remaining -= size;
+		return;
+	}
+	refc_profile_remaining = rate;
+
+	/* A sample that cannot be recorded is skipped */
+	struct refc_profile_sample *sample = malloc(sizeof(struct refc_profile_sample));
+	if (sample == NULL) {
+		return;
+	}
+	sample->ref = ref;
+	sample->tag = refc_profile_current;
+	sample->size = size;
+	size_t bucket = refc_profile_bucket(ref);
+	refc_lock(&refc_profile_lock);
+	sample->next = refc_profile_samples[bucket];
+	refc_profile_samples[bucket] = sample;
+	refc_unlock(&refc_profile_lock);
+	ref->sampled = 1;
+}
+
+/* Removes the sample of a block that is about to be freed */
+static void refc_profile_forget(struct refc_ref *ref) {
+	refc_lock(&refc_profile_lock);
+	struct refc_profile_sample **link = &refc_profile_samples[refc_profile_bucket(ref)];
+	while ((*link)->ref != ref) {
+		link = &((*link)->next);
+	}
+	struct refc_profile_sample *sample = *link;
+	*link = sample->next;
+	refc_unlock(&refc_profile_lock);
+	free(sample);
+}
+
+int refc_profile_report(void (*report)(void *context, const struct refc_profile_site *site),
+		void *context) {
+	size_t rate = atomic_load_explicit(&refc_profile_rate, memory_order_relaxed);
+	struct refc_profile_site *sites = NULL;
+	size_t count = 0;
+	size_t capacity = 0;
+	refc_lock(&refc_profile_lock);
+	for (size_t bucket = 0; bucket < REFC_PROFILE_BUCKETS; bucket++) {
+		for (struct refc_profile_sample *sample = refc_profile_samples[bucket]; sample != NULL; sample = sample->next) {
+			size_t i = 0;
+			while (i < count && sites[i].tag != sample->tag
+					&& (sites[i].tag == NULL || sample->tag == NULL || strcmp(sites[i].tag, sample->tag) != 0)) {
+				i++;
+			}
+			if (i == count) {
+				if (count == capacity) {
+					capacity = capacity != 0 ? capacity * 2 : 16;
+					struct refc_profile_site *grown = realloc(sites, capacity * sizeof(struct refc_profile_site));
+					if (grown == NULL) {
+						refc_unlock(&refc_profile_lock);
+						free(sites);
+						return 0;
+					}
+					sites = grown;
+				}
+				sites[count++] = (struct refc_profile_site) { sample->tag, 0, 0, 0 };
+			}
+			sites[i].blocks++;
+			sites[i].bytes += sample->size;
+			/* A sample stands for the bytes allocated since the previous one */
+			sites[i].estimated_bytes += sample->size > rate ? sample->size : rate;
+		}
+	}
+	refc_unlock(&refc_profile_lock);
+
+	/* Reports are made without the lock, so that they can allocate */
+	for (size_t i = 0; i < count; i++) {
+		(report)(context, &sites[i]);
+	}
+	free(sites);
+	return 1;
+}
+#endif
+
+#ifdef REFC_H_POOL
+static struct refc_pool_class refc_pool_classes[REFC_POOL_CLASSES];
+
+/* Rounded so that every block of a slab is aligned like the first one */
+static size_t refc_pool_block_size(unsigned char size_class) {
+	size_t size = sizeof(struct refc_ref) + ((size_t) REFC_POOL_MIN_SIZE << size_class);
+	return (size + _Alignof(struct refc_ref) - 1) & ~(_Alignof(struct refc_ref) - 1);
+}
+
+static unsigned char refc_pool_size_class(size_t size) {
+	unsigned char size_class = 0;
+	size_t class_size = REFC_POOL_MIN_SIZE;
+	while (class_size < size && size_class < REFC_POOL_CLASSES) {
+		class_size <<= 1;
+		size_class++;
+	}
+	return size_class;
+}
+
+static struct refc_ref **refc_pool_next(struct refc_ref *ref) {
+	return (struct refc_ref **) ref->block;
+}
+
+/*
+ * Carves a new slab into blocks of the given size class
+ * and puts them in the free list. Slabs are never returned to malloc.
+ */
+static int refc_pool_refill(struct refc_pool_class *pool, unsigned char size_class) {
+	size_t block_size = refc_pool_block_size(size_class);
+	size_t count = REFC_H_POOL_SLAB_SIZE / block_size;
+	if (count == 0) {
+		count = 1;
+	}
+	unsigned char *slab = malloc(count * block_size);
+	if (slab == NULL) {
+		return 0;
+	}
+	for (size_t i = count; i > 0; i--) {
+		struct refc_ref *ref = (struct refc_ref *) (slab + (i - 1) * block_size);
+		*refc_pool_next(ref) = pool->free;
+		pool->free = ref;
+	}
+	return 1;
+}
+
+/* Moves up to `count` blocks from the shared free list to a cache */
+static void refc_pool_take(unsigned char size_class, struct refc_pool_cache *cache, size_t count) {
+	struct refc_pool_class *pool = &refc_pool_classes[size_class];
+	refc_lock(&pool->lock);
+	if (pool->free == NULL) {
+		refc_pool_refill(pool, size_class);
+	}
+	while (count > 0 && pool->free != NULL) {
+		struct refc_ref *ref = pool->free;
+		pool->free = *refc_pool_next(ref);
+		*refc_pool_next(ref) = cache->free;
+		cache->free = ref;
+		cache->count++;
+		count--;
+	}
+	refc_unlock(&pool->lock);
+}
+
+/* Moves up to `count` blocks from a cache to the shared free list */
+static void refc_pool_put(unsigned char size_class, struct refc_pool_cache *cache, size_t count) {
+	struct refc_pool_class *pool = &refc_pool_classes[size_class];
+	refc_lock(&pool->lock);
+	while (count > 0 && cache->free != NULL) {
+		struct refc_ref *ref = cache->free;
+		cache->free = *refc_pool_next(ref);
+		cache->count--;
+		*refc_pool_next(ref) = pool->free;
+		pool->free = ref;
+		count--;
+	}
+	refc_unlock(&pool->lock);
+}
+
+/* Returns a block to the cache of its size class, spilling half of a full cache */
+static void refc_pool_cache_push(struct refc_thread *thread, struct refc_ref *ref) {
+	struct refc_pool_cache *cache = &(thread->pool_cache[ref->size_class]);
+	*refc_pool_next(ref) = cache->free;
+	cache->free = ref;
+	cache->count++;
+	if (cache->count > REFC_H_POOL_CACHE_SIZE) {
+		refc_pool_put(ref->size_class, cache, REFC_H_POOL_CACHE_SIZE / 2);
+	}
+}
+
+/* Moves all blocks released by other threads into the caches of `thread` */
+static void refc_pool_reclaim(struct refc_thread *thread) {
+	struct refc_ref *ref = atomic_exchange_explicit(&(thread->pool_remote), NULL, memory_order_acquire);
+	while (ref != NULL) {
+		struct refc_ref *next = *refc_pool_next(ref);
+		refc_pool_cache_push(thread, ref);
+		ref = next;
+	}
+}
+
+static struct refc_ref *refc_pool_allocate(unsigned char size_class) {
+	struct refc_pool_cache fallback = { NULL, 0 };
+	struct refc_thread *thread = refc_thread_get();
+	struct refc_pool_cache *cache = thread != NULL ? &(thread->pool_cache[size_class]) : &fallback;
+	if (cache->free == NULL && thread != NULL) {
+		refc_pool_reclaim(thread);
+	}
+	if (cache->free == NULL) {
+		refc_pool_take(size_class, cache, thread != NULL ? REFC_H_POOL_CACHE_SIZE / 2 : 1);
+	}
+	struct refc_ref *ref = cache->free;
+	if (ref == NULL) {
+		return NULL;
+	}
+	cache->free = *refc_pool_next(ref);
+	cache->count--;
+	ref->pool_owner = thread;
+	return ref;
+}
+
+/*
+ * Returns a block to the cache of the thread that allocated it.
+ * Blocks released on other threads are handed over through a lock-free
+ * list that the owning thread reclaims in bulk when its cache runs empty.
+ */
+static void refc_pool_free(struct refc_ref *ref) {
+	struct refc_thread *owner = ref->pool_owner;
+	if (owner == refc_thread_current && owner != NULL) {
+		refc_pool_cache_push(owner, ref);
+		return;
+	}
+	if (owner == NULL) {
+		struct refc_pool_cache cache = { ref, 1 };
+		*refc_pool_next(ref) = NULL;
+		refc_pool_put(ref->size_class, &cache, 1);
+		return;
+	}
+	struct refc_ref *head = atomic_load_explicit(&(owner->pool_remote), memory_order_relaxed);
+	do {
+		*refc_pool_next(ref) = head;
+	} while (!atomic_compare_exchange_weak_explicit(&(owner->pool_remote), &head, ref,
+				memory_order_release, memory_order_relaxed));
+}
+#endif
+
+/* A chunk of arena memory, followed by the blocks allocated from it */
+struct refc_arena_chunk {
+	struct refc_arena_chunk *next;
+
+	_Alignas(struct refc_ref) unsigned char memory[];
+};
+
+struct refc_arena {
+	/* Chunks in reverse order of allocation, the first one is being filled */
+	struct refc_arena_chunk *chunks;
+
+	/* Free space in the first chunk */
+	unsigned char *top;
+	unsigned char *end;
+};
+
+struct refc_arena *refc_arena_create(void) {
+	struct refc_arena *arena = malloc(sizeof(struct refc_arena));
+	if (arena == NULL) {
+		return NULL;
+	}
+	arena->chunks = NULL;
+	arena->top = NULL;
+	arena->end = NULL;
+	return arena;
+}
+
+void refc_arena_destroy(struct refc_arena *arena) {
+	struct refc_arena_chunk *chunk = arena->chunks;
+	while (chunk != NULL) {
+		struct refc_arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	free(arena);
+}
+
+/* Returns `size` bytes of arena memory aligned for a struct refc_ref */
+static void *refc_arena_bump(struct refc_arena *arena, size_t size) {
+	size = (size + _Alignof(struct refc_ref) - 1) & ~(_Alignof(struct refc_ref) - 1);
+	if ((size_t) (arena->end - arena->top) < size) {
+		size_t capacity = size > REFC_H_ARENA_CHUNK_SIZE ? size : REFC_H_ARENA_CHUNK_SIZE;
+		struct refc_arena_chunk *chunk = malloc(sizeof(struct refc_arena_chunk) + capacity);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->top = chunk->memory;
+		arena->end = chunk->memory + capacity;
+	}
+	void *memory = arena->top;
+	arena->top += size;
+	return memory;
+}
+
+struct refc_ref *refc_allocate(size_t size) {
+	return refc_allocate_dtor(size, NULL);
+}
+
+struct refc_ref *refc_allocate_dtor(size_t size, void (*destructor)(void *)) {
+	return refc_allocate_ex(size, destructor,
+			atomic_load_explicit(&refc_allocator, memory_order_acquire));
+}
+
+void refc_set_allocator(const struct refc_allocator *allocator) {
+	atomic_store_explicit(&refc_allocator, allocator, memory_order_release);
+}
+
+/* Registered types, type `id` is at index `id - 1` */
+static struct refc_type refc_types[REFC_H_MAX_TYPES];
+static atomic_uint refc_type_count;
+
+/* The types of destructors, an open-addressing hash table of type ids */
+static _Atomic uint16_t refc_destructor_types[REFC_H_MAX_TYPES];
+static atomic_bool refc_destructor_types_lock;
+
+refc_type_id refc_register_type(void (*destructor)(void *), size_t size, const char *name) {
+	unsigned int count = atomic_load_explicit(&refc_type_count, memory_order_relaxed);
+	do {
+		if (count == REFC_H_MAX_TYPES || count == UINT16_MAX) {
+			return 0;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&refc_type_count, &count, count + 1,
+				memory_order_relaxed, memory_order_relaxed));
+
+	struct refc_type *type = &refc_types[count];
+	type->destructor = destructor;
+	type->size = size;
+	type->name = name;
+#ifdef REFC_H_POOL
+	type->size_class = refc_pool_size_class(size);
+#endif
+	return count + 1;
+}
+
+const char *refc_type_name(refc_type_id type) {
+	return type != 0 ? refc_types[type - 1].name : NULL;
+}
+
+/*
+ * Returns the type of blocks allocated with a destructor but no type,
+ * registering it on first use. Returns 0 if it cannot be registered.
+ */
+static refc_type_id refc_destructor_type(void (*destructor)(void *)) {
+	size_t start = (size_t) (((uintptr_t) destructor >> 4) * 2654435761u) % REFC_H_MAX_TYPES;
+	size_t slot = start;
+	for (size_t probe = 0; probe < REFC_H_MAX_TYPES; probe++) {
+		refc_type_id type = atomic_load_explicit(&refc_destructor_types[slot], memory_order_acquire);
+		if (type == 0) {
+			break;
+		}
+		if (refc_types[type - 1].destructor == destructor) {
+			return type;
+		}
+		slot = (slot + 1) % REFC_H_MAX_TYPES;
+	}
+
+	/* Not found, look again and insert while holding the lock */
+	refc_type_id type = 0;
+	refc_lock(&refc_destructor_types_lock);
+	slot = start;
+	for (size_t probe = 0; probe < REFC_H_MAX_TYPES; probe++) {
+		type = atomic_load_explicit(&refc_destructor_types[slot], memory_order_relaxed);
+		if (type == 0) {
+			type = refc_register_type(destructor, 0, NULL);
+			if (type != 0) {
+				atomic_store_explicit(&refc_destructor_types[slot], type, memory_order_release);
+			}
+			break;
+		}
+		if (refc_types[type - 1].destructor == destructor) {
+			break;
+		}
+		type = 0;
+		slot = (slot + 1) % REFC_H_MAX_TYPES;
+	}
+	refc_unlock(&refc_destructor_types_lock);
+	return type;
+}
+
+#ifdef REFC_H_DEBUG
+#define REFC_DEBUG_SHARDS 64
+
+/* A part of the registry of live blocks, a list through live_next */
+struct refc_debug_shard {
+	atomic_bool lock;
+	struct refc_ref *head;
+	size_t count;
+};
+
+static struct refc_debug_shard refc_debug_shards[REFC_DEBUG_SHARDS];
+
+static struct refc_debug_shard *refc_debug_shard_of(struct refc_ref *ref) {
+	return &refc_debug_shards[((uintptr_t) ref / sizeof(struct refc_ref)) % REFC_DEBUG_SHARDS];
+}
+
+static void refc_debug_register(struct refc_ref *ref) {
+	struct refc_debug_shard *shard = refc_debug_shard_of(ref);
+	refc_lock(&shard->lock);
+	ref->live_prev = NULL;
+	ref->live_next = shard->head;
+	if (shard->head != NULL) {
+		shard->head->live_prev = ref;
+	}
+	shard->head = ref;
+	shard->count++;
+	refc_unlock(&shard->lock);
+}
+
+static void refc_debug_unregister(struct refc_ref *ref) {
+	struct refc_debug_shard *shard = refc_debug_shard_of(ref);
+	refc_lock(&shard->lock);
+	if (ref->live_prev != NULL) {
+		ref->live_prev->live_next = ref->live_next;
+	} else {
+		shard->head = ref->live_next;
+	}
+	if (ref->live_next != NULL) {
+		ref->live_next->live_prev = ref->live_prev;
+	}
+	shard->count--;
+	refc_unlock(&shard->lock);
+}
+
+size_t refc_debug_live(void) {
+	size_t live = 0;
+	for (size_t i = 0; i < REFC_DEBUG_SHARDS; i++) {
+		refc_lock(&(refc_debug_shards[i].lock));
+		live += refc_debug_shards[i].count;
+		refc_unlock(&(refc_debug_shards[i].lock));
+	}
+	return live;
+}
+#endif
+
+/* Initializes the header of a newly allocated block, except for its backend */
+static void refc_init_ref(struct refc_ref *ref, size_t size, refc_type_id type) {
+#ifdef REFC_H_BIASED
+	struct refc_thread *owner = refc_thread_get();
+	ref->owner = owner;
+	ref->biased_count = owner != NULL;
+	atomic_init(&(ref->shared_count), owner != NULL ? 0 : REFC_BIASED_ONE | REFC_BIASED_MERGED);
+#else
+	ref->reference_count = 1;
+#endif
+#ifdef REFC_H_SHARDED
+	ref->shards = NULL;
+#endif
+	ref->type = (uint16_t) type;
+
+#ifdef REFC_BLOCK_SIZE
+	ref->size = size;
+#endif
+#ifdef REFC_H_STATS
+	refc_stats_add(REFC_STAT_ALLOCATIONS, 1);
+	refc_stats_add(REFC_STAT_ALLOCATED_BYTES, size);
+#endif
+#ifdef REFC_H_PROFILE
+	/* Arena blocks can be freed without refc_free, they are not sampled */
+	if (ref->backend != REFC_BACKEND_ARENA) {
+		refc_profile_allocated(ref, size);
+	} else {
+		ref->sampled = 0;
+	}
+#endif
+#if !defined(REFC_BLOCK_SIZE) && !defined(REFC_H_PROFILE)
+	(void) size;
+#endif
+
+#ifdef REFC_H_WEAK
+	atomic_init(&(ref->weak), NULL);
+#endif
+
+#ifdef REFC_LINKS
+	ref->links = NULL;
+	ref->parents = NULL;
+#endif
+
+#ifdef REFC_H_COLLECT
+	atomic_init(&(ref->collect_flags), 0);
+	ref->color = REFC_BLACK;
+#endif
+
+#ifdef REFC_CYCLE_CHECK
+    ref->order = 0;
+    ref->visited = 0;
+#endif
+#ifdef REFC_H_DEBUG
+	if (ref->backend != REFC_BACKEND_ARENA) {
+		refc_debug_register(ref);
+	}
+#endif
+
+#if defined(REFC_H_SINGLE_THREADED) && defined(REFC_H_DEBUG)
+	ref->thread = &refc_thread_id;
+#endif
+}
+
+/* Allocates a block from the built-in allocator and sets its backend */
+static struct refc_ref *refc_allocate_builtin(size_t size, refc_type_id type) {
+#ifdef REFC_H_POOL
+	unsigned char size_class = type != 0 && refc_types[type - 1].size == size
+		? refc_types[type - 1].size_class
+		: refc_pool_size_class(size);
+	if (size_class < REFC_POOL_CLASSES) {
+		struct refc_ref *ref = refc_pool_allocate(size_class);
+		if (ref != NULL) {
+			ref->backend = REFC_BACKEND_POOL;
+			ref->size_class = size_class;
+		}
+		return ref;
+	}
+#else
+	(void) type;
+#endif
+	struct refc_ref *ref = malloc(sizeof(struct refc_ref) + size);
+	if (ref != NULL) {
+		ref->backend = REFC_BACKEND_MALLOC;
+	}
+	return ref;
+}
+
+/* Allocates a block of the given type through `allocator`, NULL for built-in */
+static struct refc_ref *refc_allocate_type(size_t size, refc_type_id type,
+		const struct refc_allocator *allocator) {
+	struct refc_ref *ref;
+	if (allocator == NULL) {
+		ref = refc_allocate_builtin(size, type);
+		if (ref == NULL) {
+			return NULL;
+		}
+	} else {
+		struct refc_prefix *prefix = (allocator->allocate)(allocator->context,
+				sizeof(struct refc_prefix) + sizeof(struct refc_ref) + size);
+		if (prefix == NULL) {
+			return NULL;
+		}
+		prefix->allocator = allocator;
+		ref = (struct refc_ref *) prefix->ref;
+		ref->backend = REFC_BACKEND_ALLOCATOR;
+	}
+	refc_init_ref(ref, size, type);
+	return ref;
+}
+
+struct refc_ref *refc_allocate_ex(size_t size, void (*destructor)(void *),
+		const struct refc_allocator *allocator) {
+	refc_type_id type = 0;
+	if (destructor != NULL && (type = refc_destructor_type(destructor)) == 0) {
+		return NULL;
+	}
+	return refc_allocate_type(size, type, allocator);
+}
+
+/* The cache lines in front of a padded block, which hold its header */
+#define REFC_PADDED_HEADER ((offsetof(struct refc_ref, block) + REFC_H_CACHE_LINE - 1) \
+	/ REFC_H_CACHE_LINE * REFC_H_CACHE_LINE)
+
+/*
+ * How far into its first cache line a padded block starts. Non-zero when
+ * REFC_H_ALIGN is below the alignment of the header, which then moves
+ * back to an aligned address and puts its last fields, but never the
+ * reference count, on the line of the block.
+ */
+#define REFC_PADDED_SKEW (offsetof(struct refc_ref, block) % _Alignof(struct refc_ref))
+
+_Static_assert(REFC_H_CACHE_LINE % _Alignof(struct refc_ref) == 0,
+		"REFC_H_CACHE_LINE must be a multiple of the alignment of blocks and their headers");
+
+/* Allocates a block that starts a cache line, with its header on the lines before */
+static struct refc_ref *refc_allocate_padded(size_t size) {
+	if (size > SIZE_MAX - REFC_PADDED_SKEW - REFC_H_CACHE_LINE) {
+		return NULL;
+	}
+	size_t padded = (size + REFC_PADDED_SKEW + REFC_H_CACHE_LINE - 1) / REFC_H_CACHE_LINE * REFC_H_CACHE_LINE;
+	if (padded > SIZE_MAX - REFC_PADDED_HEADER) {
+		return NULL;
+	}
+	unsigned char *memory = aligned_alloc(REFC_H_CACHE_LINE, REFC_PADDED_HEADER + padded);
+	if (memory == NULL) {
+		return NULL;
+	}
+	struct refc_ref *ref = (struct refc_ref *) (memory + REFC_PADDED_HEADER + REFC_PADDED_SKEW
+			- offsetof(struct refc_ref, block));
+	ref->backend = REFC_BACKEND_PADDED;
+	return ref;
+}
+
+/* Allocates a block laid out as told by REFC_ALLOCATE_PADDED */
+static struct refc_ref *refc_allocate_layout(size_t size, void (*destructor)(void *), unsigned int flags) {
+	if (!(flags & REFC_ALLOCATE_PADDED)) {
+		return refc_allocate_dtor(size, destructor);
+	}
+	refc_type_id type = 0;
+	if (destructor != NULL && (type = refc_destructor_type(destructor)) == 0) {
+		return NULL;
+	}
+	struct refc_ref *ref = refc_allocate_padded(size);
+	if (ref == NULL) {
+		return NULL;
+	}
+	refc_init_ref(ref, size, type);
+	return ref;
+}
+
+struct refc_ref *refc_allocate_flags(size_t size, void (*destructor)(void *), unsigned int flags) {
+#ifdef REFC_H_SHARDED
+	if (flags & REFC_ALLOCATE_SHARDED) {
+		struct refc_shards *shards = aligned_alloc(_Alignof(struct refc_shards), sizeof(struct refc_shards));
+		if (shards == NULL) {
+			return NULL;
+		}
+		for (size_t i = 0; i < REFC_H_COUNT_SHARDS; i++) {
+			atomic_init(&(shards->shard[i].count), 0);
+		}
+		atomic_init(&(shards->folded), 0);
+		struct refc_ref *ref = refc_allocate_layout(size, destructor, flags);
+		if (ref == NULL) {
+			free(shards);
+			return NULL;
+		}
+		ref->shards = shards;
+		return ref;
+	}
+#endif
+	return refc_allocate_layout(size, destructor, flags);
+}
+
+#ifdef REFC_H_SHARDED
+void refc_unshard(struct refc_ref *ref) {
+	struct refc_shards *shards = ref->shards;
+	if (shards == NULL || atomic_exchange_explicit(&(shards->folded), 1, memory_order_relaxed)) {
+		return;
+	}
+	/*
+	 * Each shard is folded exactly once, its references being counted on
+	 * the shard before and on the reference count after. The acquire
+	 * ordering takes in the writes published by releases on the shards,
+	 * the release ordering passes them on to the thread that disposes of
+	 * the block.
+	 */
+	atomic_fetch_add_explicit(&(ref->reference_count), REFC_SHARD_BIAS, memory_order_relaxed);
+	intptr_t sum = 0;
+	for (size_t i = 0; i < REFC_H_COUNT_SHARDS; i++) {
+		sum += atomic_exchange_explicit(&(shards->shard[i].count), REFC_SHARD_FOLDED, memory_order_acquire);
+	}
+	atomic_fetch_add_explicit(&(ref->reference_count), (refc_count_value) sum - REFC_SHARD_BIAS,
+			memory_order_release);
+}
+#endif
+
+struct refc_ref *refc_allocate_typed(refc_type_id type) {
+	if (type == 0 || type > atomic_load_explicit(&refc_type_count, memory_order_relaxed)) {
+		return NULL;
+	}
+	return refc_allocate_type(refc_types[type - 1].size, type,
+			atomic_load_explicit(&refc_allocator, memory_order_acquire));
+}
+
+refc_type_id refc_type_of(struct refc_ref *ref) {
+	return ref->type;
+}
+
+struct refc_ref *refc_arena_allocate(struct refc_arena *arena, size_t size,
+		void (*destructor)(void *)) {
+	refc_type_id type = 0;
+	if (destructor != NULL && (type = refc_destructor_type(destructor)) == 0) {
+		return NULL;
+	}
+	struct refc_ref *ref = refc_arena_bump(arena, sizeof(struct refc_ref) + size);
+	if (ref == NULL) {
+		return NULL;
+	}
+	ref->backend = REFC_BACKEND_ARENA;
+	refc_init_ref(ref, size, type);
+	return ref;
+}
+
+/* Returns the memory of a block to the backend it was allocated from */
+static void refc_deallocate(struct refc_ref *ref) {
+	switch (ref->backend) {
+	case REFC_BACKEND_MALLOC:
+		free(ref);
+		break;
+#ifdef REFC_H_POOL
+	case REFC_BACKEND_POOL:
+		refc_pool_free(ref);
+		break;
+#endif
+	case REFC_BACKEND_ALLOCATOR: {
+		struct refc_prefix *prefix = refc_get_prefix(ref);
+		(prefix->allocator->free)(prefix->allocator->context, prefix);
+		break;
+	}
+	case REFC_BACKEND_ARENA:
+		break;
+	case REFC_BACKEND_PADDED:
+		free(ref->block - REFC_PADDED_SKEW - REFC_PADDED_HEADER);
+		break;
+	}
+}
+
+#ifdef REFC_H_WEAK
+/*
+ * The control block of weak references, which outlives its target.
+ * The target holds a weak reference of its own until it is destructed.
+ */
+struct refc_weak_ref {
+	/* Held while clearing the target or retaining it */
+	atomic_bool lock;
+
+	/* The referenced block, NULL once it has no references left */
+	struct refc_ref *target;
+
+	/* Weak references, including the one held by the target */
+	atomic_size_t weak_count;
+};
+
+void refc_weak_release(struct refc_weak_ref *weak) {
+	if (atomic_fetch_sub_explicit(&(weak->weak_count), 1, memory_order_acq_rel) == 1) {
+		free(weak);
+	}
+}
+#endif
+
+/* Calls the destructor of a block that is no longer referenced */
+static void refc_destruct(struct refc_ref *ref) {
+#ifdef REFC_H_WEAK
+	struct refc_weak_ref *weak = atomic_load_explicit(&(ref->weak), memory_order_acquire);
+	if (weak != NULL) {
+		refc_lock(&(weak->lock));
+		weak->target = NULL;
+		refc_unlock(&(weak->lock));
+		refc_weak_release(weak);
+	}
+#endif
+	if (ref->type != 0) {
+		void (*destructor)(void *) = refc_types[ref->type - 1].destructor;
+		if (destructor != NULL) {
+#ifdef REFC_H_STATS
+			unsigned long long start = refc_stats_now();
+			(destructor)(&ref->block);
+			refc_stats_add(REFC_STAT_DESTRUCTOR_NS, refc_stats_now() - start);
+#else
+			(destructor)(&ref->block);
+#endif
+		}
+	}
+}
+
+#ifdef REFC_LINKS
+static void refc_unlink_all(struct refc_ref *ref);
+#endif
+
+#ifdef REFC_H_COLLECT
+static void refc_collect_candidate(struct refc_ref *ref, size_t n);
+static void refc_collect_forget(struct refc_ref *ref);
+#endif
+
+/* Frees a block after its destructor was called */
+static void refc_free(struct refc_ref *ref) {
+#ifdef REFC_LINKS
+	refc_unlink_all(ref);
+#endif
+#ifdef REFC_H_STATS
+	refc_stats_add(REFC_STAT_FREES, 1);
+	refc_stats_add(REFC_STAT_FREED_BYTES, ref->size);
+#endif
+#ifdef REFC_H_PROFILE
+	if (ref->sampled) {
+		refc_profile_forget(ref);
+	}
+#endif
+#ifdef REFC_H_DEBUG
+	if (ref->backend != REFC_BACKEND_ARENA) {
+		refc_debug_unregister(ref);
+	}
+#endif
+#ifdef REFC_H_SHARDED
+	free(ref->shards);
+#endif
+	refc_deallocate(ref);
+}
+
+/* Calls the destructor of a block that is no longer referenced and frees it */
+static void refc_dispose(struct refc_ref *ref) {
+	refc_destruct(ref);
+	refc_free(ref);
+}
+
+#ifdef REFC_H_DEFERRED
+/* Blocks waiting for refc_drain, linked through dispose_next */
+static struct refc_ref * _Atomic refc_deferred;
+
+/* Queues a list of blocks from `head` to `tail` for refc_drain */
+static void refc_defer(struct refc_ref *head, struct refc_ref *tail) {
+	tail->dispose_next = atomic_load_explicit(&refc_deferred, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&refc_deferred, &(tail->dispose_next), head,
+				memory_order_release, memory_order_relaxed)) {
+	}
+}
+
+/* Held by refc_drain while it takes blocks off the queue */
+static atomic_bool refc_drain_lock;
+
+/*
+ * Takes up to `budget` queued blocks, so that what a drain leaves behind
+ * stays queued and is not walked again. refc_defer only pushes blocks in
+ * front of the first one, the blocks after it are cut off under the lock.
+ * The first one is only taken once no blocks are pushed in front of it.
+ */
+static struct refc_ref *refc_drain_take(size_t budget) {
+	refc_lock(&refc_drain_lock);
+	struct refc_ref *first = atomic_load_explicit(&refc_deferred, memory_order_acquire);
+	struct refc_ref *taken = NULL;
+	while (first != NULL) {
+		struct refc_ref *last = first;
+		size_t count = 0;
+		while (count < budget && last->dispose_next != NULL) {
+			last = last->dispose_next;
+			count++;
+		}
+		if (count == budget) {
+			taken = first->dispose_next;
+			first->dispose_next = last->dispose_next;
+			last->dispose_next = NULL;
+			break;
+		}
+		struct refc_ref *expected = first;
+		if (atomic_compare_exchange_strong_explicit(&refc_deferred, &expected, NULL,
+					memory_order_acquire, memory_order_acquire)) {
+			taken = first;
+			break;
+		}
+		first = expected;
+	}
+	refc_unlock(&refc_drain_lock);
+	return taken;
+}
+
+size_t refc_drain(size_t budget) {
+	size_t disposed = 0;
+	while (disposed < budget) {
+		struct refc_ref *ref = refc_drain_take(budget - disposed);
+		if (ref == NULL) {
+			break;
+		}
+		while (ref != NULL) {
+			struct refc_ref *next = ref->dispose_next;
+			refc_dispose(ref);
+			disposed++;
+			ref = next;
+		}
+	}
+	return disposed;
+}
+#endif
+
+#if defined(REFC_H_ITERATIVE) && !defined(REFC_H_DEFERRED)
+/* Blocks released by destructors running on this thread */
+static _Thread_local struct refc_ref *refc_pending;
+
+/* Set while this thread is disposing of blocks */
+static _Thread_local _Bool refc_disposing;
+
+/* Disposes of pending blocks, including the ones released meanwhile */
+static void refc_dispose_pending(void) {
+	while (refc_pending != NULL) {
+		struct refc_ref *ref = refc_pending;
+		refc_pending = ref->dispose_next;
+		refc_dispose(ref);
+	}
+	refc_disposing = 0;
+}
+#endif
+
+/* Disposes of a block that has no references left and is not borrowed */
+static void refc_reclaim(struct refc_ref *ref) {
+#ifdef REFC_H_DEFERRED
+	refc_defer(ref, ref);
+#elif defined(REFC_H_ITERATIVE)
+	if (refc_disposing) {
+		ref->dispose_next = refc_pending;
+		refc_pending = ref;
+		return;
+	}
+	refc_disposing = 1;
+	refc_dispose(ref);
+	refc_dispose_pending();
+#else
+	refc_dispose(ref);
+#endif
+}
+
+#ifdef REFC_H_EPOCH
+/*
+ * The global epoch, starting at 1. Blocks that reach a reference count
+ * of 0 wait in the limbo list of the epoch their releasing thread is in.
+ * The epoch only advances once every thread in an epoch is in the
+ * current one, so after advancing to epoch `e + 1` no thread can still
+ * borrow the blocks in the limbo list of epoch `e - 2` and they are
+ * reclaimed. Its list is then reused for epoch `e + 1`.
+ */
+static atomic_size_t refc_epoch = 1;
+static struct refc_ref * _Atomic refc_limbo[3];
+
+/* Held while advancing the epoch */
+static atomic_bool refc_epoch_lock;
+
+/* Outermost exits between attempts to advance by threads that retire nothing */
+#define REFC_EPOCH_ADVANCE_INTERVAL 64
+
+int refc_epoch_enter(void) {
+	struct refc_thread *thread = refc_thread_get();
+	if (thread == NULL) {
+		return 0;
+	}
+	if (thread->epoch_depth++ > 0) {
+		return 1;
+	}
+	/* The epoch is checked again after publishing it, in case it advanced */
+	size_t epoch = atomic_load(&refc_epoch);
+	for (;;) {
+		atomic_store(&(thread->epoch), epoch);
+		size_t current = atomic_load(&refc_epoch);
+		if (current == epoch) {
+			return 1;
+		}
+		epoch = current;
+	}
+}
+
+/* Pushes a list of blocks from `head` to `tail` to a limbo list */
+static void refc_limbo_push(struct refc_ref * _Atomic *limbo, struct refc_ref *head, struct refc_ref *tail) {
+	tail->dispose_next = atomic_load_explicit(limbo, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(limbo, &(tail->dispose_next), head,
+				memory_order_release, memory_order_relaxed)) {
+	}
+}
+
+/*
+ * Advances the epoch if no thread is in an older one, taking the blocks
+ * that can be reclaimed into `reclaimed`.
+ *
+ * Returns 1 if the epoch advanced.
+ */
+static int refc_epoch_advance(struct refc_ref **reclaimed) {
+	/* Loaded first so that threads do not write the lock while another holds it */
+	if (atomic_load_explicit(&refc_epoch_lock, memory_order_relaxed)
+			|| atomic_exchange_explicit(&refc_epoch_lock, 1, memory_order_acquire)) {
+		return 0;
+	}
+	size_t epoch = atomic_load(&refc_epoch);
+	for (struct refc_thread *thread = atomic_load(&refc_threads); thread != NULL; thread = thread->next) {
+		size_t thread_epoch = atomic_load(&(thread->epoch));
+		if (thread_epoch != 0 && thread_epoch != epoch) {
+			refc_unlock(&refc_epoch_lock);
+			return 0;
+		}
+	}
+	/* Taken before advancing, after which threads add to the list again */
+	*reclaimed = atomic_exchange_explicit(&refc_limbo[(epoch + 1) % 3], NULL, memory_order_acquire);
+	atomic_store(&refc_epoch, epoch + 1);
+	refc_unlock(&refc_epoch_lock);
+	return 1;
+}
+
+/* Reclaims the blocks of a list taken by refc_epoch_advance */
+static void refc_epoch_reclaim(struct refc_thread *thread, struct refc_ref *ref) {
+	if (thread != NULL) {
+		thread->epoch_reclaiming = 1;
+	}
+	while (ref != NULL) {
+		struct refc_ref *next = ref->dispose_next;
+		refc_reclaim(ref);
+		ref = next;
+	}
+	if (thread != NULL) {
+		thread->epoch_reclaiming = 0;
+	}
+}
+
+static _Bool refc_limbo_empty(void) {
+	for (size_t i = 0; i < 3; i++) {
+		if (atomic_load_explicit(&refc_limbo[i], memory_order_relaxed) != NULL) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void refc_epoch_exit(void) {
+	struct refc_thread *thread = refc_thread_current;
+	if (--thread->epoch_depth > 0) {
+		return;
+	}
+	atomic_store(&(thread->epoch), 0);
+
+	/*
+	 * Blocks are only reclaimed by advancing the epoch. Blocks released
+	 * while reclaiming are left to the outermost exit, which advances a
+	 * bounded number of times to keep exiting cheap.
+	 */
+	if (thread->epoch_reclaiming) {
+		return;
+	}
+	/*
+	 * Threads advance the epoch until the blocks they retired are
+	 * reclaimed, on the third advance after retiring them. Threads that
+	 * only borrow try every REFC_EPOCH_ADVANCE_INTERVAL exits, so that
+	 * they mostly exit without writing shared memory, while blocks of
+	 * threads that stopped exiting are still reclaimed.
+	 */
+	if (thread->epoch_retired != 0
+			&& atomic_load_explicit(&refc_epoch, memory_order_relaxed) >= thread->epoch_retired + 3) {
+		thread->epoch_retired = 0;
+	}
+	if (thread->epoch_retired == 0 && ++thread->epoch_exits % REFC_EPOCH_ADVANCE_INTERVAL != 0) {
+		return;
+	}
+	struct refc_ref *reclaimed;
+	for (size_t i = 0; i < 3 && !refc_limbo_empty() && refc_epoch_advance(&reclaimed); i++) {
+		refc_epoch_reclaim(thread, reclaimed);
+	}
+}
+
+void refc_epoch_synchronize(void) {
+	struct refc_thread *thread = refc_thread_get();
+	struct refc_ref *reclaimed;
+	size_t advanced = 0;
+	while (advanced < 3 || !refc_limbo_empty()) {
+		if (refc_epoch_advance(&reclaimed)) {
+			advanced++;
+			refc_epoch_reclaim(thread, reclaimed);
+		}
+	}
+}
+
+/* Retires a list of blocks from `head` to `tail` that reached a count of 0 */
+static void refc_epoch_retire(struct refc_ref *head, struct refc_ref *tail) {
+	if (refc_epoch_enter()) {
+		size_t epoch = atomic_load_explicit(&(refc_thread_current->epoch), memory_order_relaxed);
+		refc_limbo_push(&refc_limbo[epoch % 3], head, tail);
+		refc_thread_current->epoch_retired = epoch;
+		refc_epoch_exit();
+		return;
+	}
+	/* Without a thread record the epoch is held still with the lock */
+	refc_lock(&refc_epoch_lock);
+	refc_limbo_push(&refc_limbo[atomic_load(&refc_epoch) % 3], head, tail);
+	refc_unlock(&refc_epoch_lock);
+}
+#endif
+
+/* Disposes of a block that reached a reference count of 0 */
+static void refc_unreferenced(struct refc_ref *ref) {
+#ifdef REFC_H_EPOCH
+	refc_epoch_retire(ref, ref);
+#else
+	refc_reclaim(ref);
+#endif
+}
+
+#ifdef REFC_H_BIASED
+/*
+ * Folds the biased count into the shared count. Called by the owning thread
+ * when its biased count drops to 0 or when the ref is taken off its queue.
+ * A queued ref is only freed when it is taken off the queue.
+ *
+ * Returns 1 if no references are left and the block should be disposed.
+ */
+static int refc_biased_merge(struct refc_ref *ref, int dequeue) {
+	intptr_t biased = (intptr_t) ref->biased_count * REFC_BIASED_ONE;
+	ref->biased_count = 0;
+
+	intptr_t count = atomic_load_explicit(&(ref->shared_count), memory_order_relaxed);
+	intptr_t merged;
+	do {
+		merged = (count + biased) | REFC_BIASED_MERGED;
+		if (dequeue) {
+			merged &= ~(intptr_t) REFC_BIASED_QUEUED;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&(ref->shared_count), &count, merged,
+				memory_order_acq_rel, memory_order_relaxed));
+	return merged == REFC_BIASED_MERGED;
+}
+
+/* Merges all refs that other threads have queued for `thread` */
+static void refc_biased_process(struct refc_thread *thread) {
+	struct refc_ref *ref = atomic_exchange_explicit(&(thread->biased_queue), NULL, memory_order_acquire);
+	while (ref != NULL) {
+		struct refc_ref *next = ref->biased_next;
+		if (refc_biased_merge(ref, 1)) {
+			refc_unreferenced(ref);
+		}
+		ref = next;
+	}
+}
+
+/*
+ * Merges the queue of a record while no thread owns it, as the thread that
+ * owned the blocks in the queue exited. Called after queueing a ref and
+ * after a thread releases its record, the fences make sure that at least
+ * one of them sees the change of the other.
+ */
+static void refc_biased_adopt(struct refc_thread *thread) {
+	atomic_thread_fence(memory_order_seq_cst);
+	while (atomic_load_explicit(&(thread->biased_queue), memory_order_relaxed) != NULL) {
+		/* A thread that owns the record merges the queue itself */
+		_Bool in_use = 0;
+		if (!atomic_compare_exchange_strong_explicit(&(thread->in_use), &in_use, 1,
+					memory_order_acquire, memory_order_relaxed)) {
+			return;
+		}
+		refc_biased_process(thread);
+		atomic_store_explicit(&(thread->in_use), 0, memory_order_release);
+		atomic_thread_fence(memory_order_seq_cst);
+	}
+}
+
+/*
+ * Releases `n` references with the shared count.
+ *
+ * Until the owner merges the counts a negative shared count only means
+ * that the owner holds the remaining references. The ref is then queued
+ * so that the owner merges the counts and disposes of it if none are left.
+ */
+static int refc_biased_release_shared(struct refc_ref *ref, size_t n) {
+	/*
+	 * The ref is marked as queued by the same update that takes the count
+	 * negative. Once the decrement is visible another release can bring
+	 * the count to 0, so marking it afterwards could touch a freed block.
+	 * A queued ref is not disposed of until the owner dequeues it.
+	 */
+	intptr_t count = atomic_load_explicit(&(ref->shared_count), memory_order_relaxed);
+	intptr_t released;
+	do {
+		released = count - (intptr_t) n * REFC_BIASED_ONE;
+		if (released < 0 && !(released & REFC_BIASED_MERGED)) {
+			released |= REFC_BIASED_QUEUED;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&(ref->shared_count), &count, released,
+				REFC_DECREMENT_ORDER, memory_order_relaxed));
+	if (released & REFC_BIASED_MERGED) {
+		if (released == REFC_BIASED_MERGED) {
+			refc_acquire_fence();
+			return 1;
+		}
+		return 0;
+	}
+	if ((released & REFC_BIASED_QUEUED) && !(count & REFC_BIASED_QUEUED)) {
+		struct refc_thread *owner = ref->owner;
+		ref->biased_next = atomic_load_explicit(&(owner->biased_queue), memory_order_relaxed);
+		while (!atomic_compare_exchange_weak_explicit(&(owner->biased_queue), &(ref->biased_next), ref,
+					memory_order_release, memory_order_relaxed)) {
+		}
+		refc_biased_adopt(owner);
+	}
+	return 0;
+}
+#endif
+
+#ifdef REFC_H_SHARDED
+/* Hands out shards to threads in turn */
+static atomic_uint refc_shard_next;
+
+/* One more than the shard of the calling thread, 0 until it uses one */
+static _Thread_local unsigned int refc_shard_current;
+
+/*
+ * Adds `n`, which can be negative, to the calling thread's shard of a block.
+ * Returns 0 if the shards were folded and the reference count must be used.
+ *
+ * A count of references released on the shard is ordered before the fold
+ * like a decrement of the reference count, see refc_count_decrement.
+ */
+static int refc_shard_add(struct refc_shards *shards, intptr_t n) {
+	if (refc_shard_current == 0) {
+		refc_shard_current = atomic_fetch_add_explicit(&refc_shard_next, 1, memory_order_relaxed)
+			% REFC_H_COUNT_SHARDS + 1;
+	}
+	atomic_intptr_t *count = &(shards->shard[refc_shard_current - 1].count);
+	if (atomic_load_explicit(count, memory_order_relaxed) < REFC_SHARD_FOLDED / 2) {
+		return 0;
+	}
+	return atomic_fetch_add_explicit(count, n, n < 0 ? memory_order_release : memory_order_relaxed)
+		>= REFC_SHARD_FOLDED / 2;
+}
+#endif
+
+/* Adds `n` references to a block */
+static void refc_count_retain(struct refc_ref *ref, size_t n) {
+#ifdef REFC_H_STATS
+	refc_stats_add(REFC_STAT_RETAINS, n);
+#endif
+#ifdef REFC_H_SINGLE_THREADED
+#ifdef REFC_H_DEBUG
+	assert(ref->thread == &refc_thread_id);
+#endif
+	ref->reference_count += n;
+#elif defined(REFC_H_BIASED)
+	if (ref->owner == refc_thread_current && ref->biased_count > 0) {
+		ref->biased_count += n;
+		return;
+	}
+	atomic_fetch_add_explicit(&(ref->shared_count), (intptr_t) n * REFC_BIASED_ONE, memory_order_relaxed);
+#else
+#ifdef REFC_H_SHARDED
+	if (ref->shards != NULL && refc_shard_add(ref->shards, (intptr_t) n)) {
+		return;
+	}
+#endif
+	atomic_fetch_add_explicit(&(ref->reference_count), n, memory_order_relaxed);
+#endif
+}
+
+/*
+ * Removes `n` references from a block.
+ * Returns 1 if no references are left and the block should be disposed.
+ */
+static int refc_count_decrement(struct refc_ref *ref, size_t n) {
+#ifdef REFC_H_SINGLE_THREADED
+#ifdef REFC_H_DEBUG
+	assert(ref->thread == &refc_thread_id);
+#endif
+	ref->reference_count -= n;
+	return ref->reference_count == 0;
+#elif defined(REFC_H_BIASED)
+	struct refc_thread *thread = refc_thread_current;
+	if (thread != NULL && atomic_load_explicit(&(thread->biased_queue), memory_order_relaxed) != NULL) {
+		refc_biased_process(thread);
+	}
+	size_t biased = ref->owner == thread ? ref->biased_count : 0;
+	if (biased > 0) {
+		if (biased > n) {
+			ref->biased_count -= n;
+			return 0;
+		}
+		ref->biased_count = 0;
+		if (refc_biased_merge(ref, 0)) {
+			return 1;
+		}
+		n -= biased;
+		if (n == 0) {
+			return 0;
+		}
+	}
+	return refc_biased_release_shared(ref, n);
+#else
+#ifdef REFC_H_SHARDED
+	if (ref->shards != NULL && refc_shard_add(ref->shards, -(intptr_t) n)) {
+		return 0;
+	}
+#endif
+	/*
+	 * Only the value returned by the decrement tells if this was the last
+	 * reference. The release ordering publishes all writes to the block
+	 * made while holding the reference, the acquire fence makes them
+	 * visible to the thread that disposes of the block.
+	 */
+	if (atomic_fetch_sub_explicit(&(ref->reference_count), n, REFC_DECREMENT_ORDER) != n) {
+		return 0;
+	}
+	refc_acquire_fence();
+	return 1;
+#endif
+}
+
+/*
+ * Adds a reference to a block unless it has none left.
+ * Returns 1 if the reference was added.
+ */
+static int refc_count_try_increment(struct refc_ref *ref) {
+#ifdef REFC_H_SINGLE_THREADED
+	if (ref->reference_count == 0) {
+		return 0;
+	}
+	ref->reference_count++;
+	return 1;
+#elif defined(REFC_H_BIASED)
+	if (ref->owner == refc_thread_current && ref->biased_count > 0) {
+		ref->biased_count++;
+		return 1;
+	}
+	/*
+	 * Only a merged count of 0 that is not queued means that the block is
+	 * disposed of. Unmerged or queued counts are decided by the owner's
+	 * merge, which sees the added reference.
+	 */
+	intptr_t count = atomic_load_explicit(&(ref->shared_count), memory_order_relaxed);
+	do {
+		if (count == REFC_BIASED_MERGED) {
+			return 0;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&(ref->shared_count), &count, count + REFC_BIASED_ONE,
+				memory_order_relaxed, memory_order_relaxed));
+	return 1;
+#else
+#ifdef REFC_H_SHARDED
+	/* The allocation reference keeps a block with unfolded shards alive */
+	if (ref->shards != NULL && refc_shard_add(ref->shards, 1)) {
+		return 1;
+	}
+#endif
+	refc_count_value count = atomic_load_explicit(&(ref->reference_count), memory_order_relaxed);
+	do {
+		if (count == 0) {
+			return 0;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&(ref->reference_count), &count, count + 1,
+				memory_order_relaxed, memory_order_relaxed));
+	return 1;
+#endif
+}
+
+#ifdef REFC_H_SCOPE
+static size_t refc_scope_home(struct refc_thread *thread, struct refc_ref *ref) {
+	return (size_t) (((uintptr_t) ref >> 4) * 2654435761u) & (thread->scope_capacity * 2 - 1);
+}
+
+/* Returns the slot of a block in the scope index, an empty one if it is not borrowed */
+static size_t *refc_scope_slot(struct refc_thread *thread, struct refc_ref *ref) {
+	size_t slot = refc_scope_home(thread, ref);
+	while (thread->scope_index[slot] != 0
+			&& thread->scope_entries[thread->scope_index[slot] - 1].ref != ref) {
+		slot = (slot + 1) & (thread->scope_capacity * 2 - 1);
+	}
+	return &(thread->scope_index[slot]);
+}
+
+/* Empties a slot of the scope index, moving back the slots probed past it */
+static void refc_scope_unindex(struct refc_thread *thread, size_t *slot) {
+	size_t mask = thread->scope_capacity * 2 - 1;
+	size_t hole = (size_t) (slot - thread->scope_index);
+	for (size_t next = (hole + 1) & mask; thread->scope_index[next] != 0; next = (next + 1) & mask) {
+		size_t home = refc_scope_home(thread,
+				thread->scope_entries[thread->scope_index[next] - 1].ref);
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			thread->scope_index[hole] = thread->scope_index[next];
+			hole = next;
+		}
+	}
+	thread->scope_index[hole] = 0;
+}
+
+/*
+ * Takes over the last reference to a block that was just released if a
+ * scope of the calling thread borrowed it. The entry of the outermost
+ * such scope holds the reference until that scope is exited.
+ *
+ * Returns 1 if the block was kept alive.
+ */
+static int refc_scope_claim(struct refc_ref *ref) {
+	struct refc_thread *thread = refc_thread_current;
+	if (thread == NULL || thread->scope_count == 0) {
+		return 0;
+	}
+	size_t index = *refc_scope_slot(thread, ref);
+	if (index == 0) {
+		return 0;
+	}
+	/* A scope that already owned the block had its reference released */
+	struct refc_scope_entry *entry = &(thread->scope_entries[index - 1]);
+	if (entry->owned) {
+		return 0;
+	}
+	entry->owned = 1;
+	refc_count_retain(ref, 1);
+	return 1;
+}
+#endif
+
+/* Same as refc_count_try_increment, counting the added reference */
+static int refc_count_try_retain(struct refc_ref *ref) {
+#ifdef REFC_H_STATS
+	if (!refc_count_try_increment(ref)) {
+		return 0;
+	}
+	refc_stats_add(REFC_STAT_RETAINS, 1);
+	return 1;
+#else
+	return refc_count_try_increment(ref);
+#endif
+}
+
+/*
+ * Same as refc_count_decrement, keeping track of candidates for refc_collect,
+ * of blocks borrowed by scopes and of the number of releases.
+ */
+static int refc_count_release(struct refc_ref *ref, size_t n) {
+#ifdef REFC_H_STATS
+	refc_stats_add(REFC_STAT_RELEASES, n);
+#endif
+#ifdef REFC_H_COLLECT
+	refc_collect_candidate(ref, n);
+#endif
+	if (!refc_count_decrement(ref, n)) {
+		return 0;
+	}
+#ifdef REFC_H_COLLECT
+	refc_collect_forget(ref);
+#endif
+#ifdef REFC_H_SCOPE
+	if (refc_scope_claim(ref)) {
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+void refc_retain(struct refc_ref *ref) {
+	refc_count_retain(ref, 1);
+}
+
+void refc_retain_n(struct refc_ref *ref, size_t n) {
+	refc_count_retain(ref, n);
+}
+
+void refc_release(struct refc_ref *ref) {
+	if (refc_count_release(ref, 1)) {
+		refc_unreferenced(ref);
+	}
+}
+
+void refc_release_n(struct refc_ref *ref, size_t n) {
+	if (refc_count_release(ref, n)) {
+		refc_unreferenced(ref);
+	}
+}
+
+/* Number of unreferenced blocks that refc_release_array disposes of at once */
+#define REFC_RELEASE_BATCH 64
+
+void refc_release_array(struct refc_ref **refs, size_t count) {
+#if defined(REFC_H_DEFERRED) || defined(REFC_H_EPOCH)
+	/* Queue all unreferenced blocks at once */
+	struct refc_ref *head = NULL;
+	struct refc_ref *tail = NULL;
+	for (size_t i = 0; i < count; i++) {
+		if (refc_count_release(refs[i], 1)) {
+			refs[i]->dispose_next = head;
+			head = refs[i];
+			if (tail == NULL) {
+				tail = head;
+			}
+		}
+	}
+	if (head != NULL) {
+#ifdef REFC_H_EPOCH
+		refc_epoch_retire(head, tail);
+#else
+		refc_defer(head, tail);
+#endif
+	}
+#else
+#ifdef REFC_H_ITERATIVE
+	/* Blocks released by destructors are left to the outermost release */
+	if (refc_disposing) {
+		for (size_t i = 0; i < count; i++) {
+			if (refc_count_release(refs[i], 1)) {
+				refc_reclaim(refs[i]);
+			}
+		}
+		return;
+	}
+	refc_disposing = 1;
+#endif
+	struct refc_ref *batch[REFC_RELEASE_BATCH];
+	size_t batched = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (refc_count_release(refs[i], 1)) {
+			batch[batched++] = refs[i];
+		}
+		if (batched == REFC_RELEASE_BATCH || (i + 1 == count && batched > 0)) {
+			for (size_t j = 0; j < batched; j++) {
+				refc_destruct(batch[j]);
+			}
+			for (size_t j = 0; j < batched; j++) {
+				refc_free(batch[j]);
+			}
+			batched = 0;
+		}
+	}
+#ifdef REFC_H_ITERATIVE
+	refc_dispose_pending();
+#endif
+#endif
+}
+
+#ifdef REFC_H_SCOPE
+refc_scope refc_scope_enter(void) {
+	struct refc_thread *thread = refc_thread_get();
+	return thread != NULL ? thread->scope_count : 0;
+}
+
+int refc_scope_borrow(struct refc_ref *ref) {
+	struct refc_thread *thread = refc_thread_get();
+	if (thread == NULL) {
+		return 0;
+	}
+	if (thread->scope_count == thread->scope_capacity) {
+		size_t capacity = thread->scope_capacity != 0 ? thread->scope_capacity * 2 : 16;
+		size_t *index = calloc(capacity * 2, sizeof(size_t));
+		if (index == NULL) {
+			return 0;
+		}
+		struct refc_scope_entry *entries = realloc(thread->scope_entries,
+				capacity * sizeof(struct refc_scope_entry));
+		if (entries == NULL) {
+			free(index);
+			return 0;
+		}
+		free(thread->scope_index);
+		thread->scope_entries = entries;
+		thread->scope_capacity = capacity;
+		thread->scope_index = index;
+		/* The first entry found for a block is its outermost one */
+		for (size_t i = 0; i < thread->scope_count; i++) {
+			size_t *slot = refc_scope_slot(thread, entries[i].ref);
+			if (*slot == 0) {
+				*slot = i + 1;
+			}
+		}
+	}
+	size_t *slot = refc_scope_slot(thread, ref);
+	if (*slot == 0) {
+		*slot = thread->scope_count + 1;
+	}
+	thread->scope_entries[thread->scope_count++] = (struct refc_scope_entry) { ref, 0 };
+	return 1;
+}
+
+void refc_scope_exit(refc_scope scope) {
+	struct refc_thread *thread = refc_thread_current;
+	/* Destructors can borrow and claim references while the scope is exited */
+	while (thread != NULL && thread->scope_count > scope) {
+		struct refc_scope_entry entry = thread->scope_entries[--thread->scope_count];
+		size_t *slot = refc_scope_slot(thread, entry.ref);
+		if (*slot == thread->scope_count + 1) {
+			refc_scope_unindex(thread, slot);
+		}
+		if (entry.owned) {
+			refc_release(entry.ref);
+		}
+	}
+}
+#endif
+
+#ifdef REFC_THREAD_STATE
+/* Releases the record of an exiting thread for reuse by another thread */
+static void refc_thread_exit(void *data) {
+	struct refc_thread *thread = data;
+#ifdef REFC_H_SCOPE
+	/* Scopes left open release the blocks they kept alive */
+	refc_scope_exit(0);
+#endif
+#ifdef REFC_H_POOL
+	refc_pool_reclaim(thread);
+	for (unsigned char size_class = 0; size_class < REFC_POOL_CLASSES; size_class++) {
+		struct refc_pool_cache *cache = &(thread->pool_cache[size_class]);
+		refc_pool_put(size_class, cache, cache->count);
+	}
+#endif
+#ifdef REFC_H_BIASED
+	refc_biased_process(thread);
+#endif
+#ifdef REFC_H_EPOCH
+	atomic_store(&(thread->epoch), 0);
+	thread->epoch_depth = 0;
+	thread->epoch_retired = 0;
+#endif
+	refc_thread_current = NULL;
+	atomic_store_explicit(&(thread->in_use), 0, memory_order_release);
+#ifdef REFC_H_BIASED
+	/* Refs queued after the last merge are merged by whoever sees them */
+	refc_biased_adopt(thread);
+#endif
+}
+#endif
+
+void *refc_access(struct refc_ref *ref) {
+	return &ref->block;
+}
+
+void refc_init(struct refc_header *header, void (*release)(struct refc_header *header)) {
+#ifdef REFC_H_SINGLE_THREADED
+	header->reference_count = 1;
+#else
+	atomic_init(&(header->reference_count), 1);
+#endif
+	header->release = release;
+}
+
+void refc_header_retain(struct refc_header *header) {
+#ifdef REFC_H_SINGLE_THREADED
+	header->reference_count++;
+#else
+	atomic_fetch_add_explicit(&(header->reference_count), 1, memory_order_relaxed);
+#endif
+}
+
+void refc_header_release(struct refc_header *header) {
+#ifdef REFC_H_SINGLE_THREADED
+	if (--header->reference_count != 0) {
+		return;
+	}
+#else
+	/* Same ordering as for blocks, see refc_count_release */
+	if (atomic_fetch_sub_explicit(&(header->reference_count), 1, REFC_DECREMENT_ORDER) != 1) {
+		return;
+	}
+	refc_acquire_fence();
+#endif
+	(header->release)(header);
+}
+
+/* The block of a reference-counted byte buffer */
+struct refc_buf {
+	/* The bytes of the buffer */
+	unsigned char *data;
+	size_t length;
+
+	/* The buffer that owns the bytes of a slice, NULL if not a slice */
+	struct refc_ref *root;
+
+	/* Releases wrapped memory, NULL if there is none */
+	void (*release)(void *context, void *data, size_t length);
+	void *context;
+
+	/* The bytes of an allocated buffer */
+	_Alignas(REFC_H_ALIGN) unsigned char bytes[];
+};
+
+static struct refc_buf *refc_buf_of(struct refc_ref *ref) {
+	return refc_internal(ref, _Alignof(struct refc_buf));
+}
+
+static void refc_buf_destroy(void *block) {
+	struct refc_buf *buf = refc_buf_of(refc_get_ref(block));
+	if (buf->root != NULL) {
+		refc_release(buf->root);
+	} else if (buf->release != NULL) {
+		(buf->release)(buf->context, buf->data, buf->length);
+	}
+}
+
+/* Allocates a buffer block with `extra` bytes after the header */
+static struct refc_ref *refc_buf_create(unsigned char *data, size_t length, size_t extra) {
+	struct refc_ref *ref = refc_allocate_dtor(sizeof(struct refc_buf) + REFC_INTERNAL_SLACK(struct refc_buf) + extra,
+			&refc_buf_destroy);
+	if (ref == NULL) {
+		return NULL;
+	}
+	struct refc_buf *buf = refc_buf_of(ref);
+	buf->data = data != NULL ? data : buf->bytes;
+	buf->length = length;
+	buf->root = NULL;
+	buf->release = NULL;
+	buf->context = NULL;
+	return ref;
+}
+
+struct refc_ref *refc_buf_allocate(size_t length) {
+	return refc_buf_create(NULL, length, length);
+}
+
+struct refc_ref *refc_buf_wrap(void *data, size_t length,
+		void (*release)(void *context, void *data, size_t length), void *context) {
+	struct refc_ref *ref = refc_buf_create(data, length, 0);
+	if (ref != NULL) {
+		struct refc_buf *buf = refc_buf_of(ref);
+		buf->release = release;
+		buf->context = context;
+	}
+	return ref;
+}
+
+struct refc_ref *refc_buf_slice(struct refc_ref *ref, size_t offset, size_t length) {
+	struct refc_buf *parent = refc_buf_of(ref);
+	if (offset > parent->length || length > parent->length - offset) {
+		return NULL;
+	}
+	struct refc_ref *slice = refc_buf_create(parent->data + offset, length, 0);
+	if (slice != NULL) {
+		/* Slices of slices keep the owning buffer alive, not their parent */
+		struct refc_ref *root = parent->root != NULL ? parent->root : ref;
+		refc_retain(root);
+		refc_buf_of(slice)->root = root;
+	}
+	return slice;
+}
+
+void *refc_buf_data(struct refc_ref *ref) {
+	return refc_buf_of(ref)->data;
+}
+
+size_t refc_buf_length(struct refc_ref *ref) {
+	return refc_buf_of(ref)->length;
+}
+
+/* The block of an interned string */
+struct refc_interned {
+	/* The reference of the next string in the same bucket */
+	struct refc_ref *next;
+
+	size_t hash;
+	size_t length;
+	char bytes[];
+};
+
+/* A part of the interning table, a hash table with chained buckets */
+struct refc_intern_shard {
+	atomic_bool lock;
+	struct refc_ref **buckets;
+	size_t bucket_count;
+	size_t count;
+};
+
+static struct refc_intern_shard refc_intern_shards[REFC_H_INTERN_SHARDS];
+
+/* FNV-1a */
+static size_t refc_intern_hash(const unsigned char *bytes, size_t length) {
+	uint64_t hash = 14695981039346656037u;
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ bytes[i]) * 1099511628211u;
+	}
+	return (size_t) (hash ^ (hash >> 32));
+}
+
+static struct refc_interned *refc_interned_of(struct refc_ref *ref) {
+	return refc_internal(ref, _Alignof(struct refc_interned));
+}
+
+static struct refc_intern_shard *refc_intern_shard_of(size_t hash) {
+	return &refc_intern_shards[(hash >> 8) % REFC_H_INTERN_SHARDS];
+}
+
+/* Doubles the buckets of a shard, keeping the old ones on failure */
+static void refc_intern_grow(struct refc_intern_shard *shard) {
+	size_t bucket_count = shard->bucket_count != 0 ? shard->bucket_count * 2 : 16;
+	struct refc_ref **buckets = calloc(bucket_count, sizeof(struct refc_ref *));
+	if (buckets == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < shard->bucket_count; i++) {
+		struct refc_ref *entry = shard->buckets[i];
+		while (entry != NULL) {
+			struct refc_interned *interned = refc_interned_of(entry);
+			struct refc_ref *next = interned->next;
+			interned->next = buckets[interned->hash % bucket_count];
+			buckets[interned->hash % bucket_count] = entry;
+			entry = next;
+		}
+	}
+	free(shard->buckets);
+	shard->buckets = buckets;
+	shard->bucket_count = bucket_count;
+}
+
+/* Removes an interned string from the table once it is unreferenced */
+static void refc_intern_remove(void *block) {
+	struct refc_ref *ref = refc_get_ref(block);
+	struct refc_interned *interned = refc_interned_of(ref);
+	struct refc_intern_shard *shard = refc_intern_shard_of(interned->hash);
+	refc_lock(&(shard->lock));
+	struct refc_ref **entry = &(shard->buckets[interned->hash % shard->bucket_count]);
+	while (*entry != ref) {
+		entry = &(refc_interned_of(*entry)->next);
+	}
+	*entry = interned->next;
+	shard->count--;
+	refc_unlock(&(shard->lock));
+}
+
+struct refc_ref *refc_intern(const void *bytes, size_t length) {
+	size_t hash = refc_intern_hash(bytes, length);
+	struct refc_intern_shard *shard = refc_intern_shard_of(hash);
+	refc_lock(&(shard->lock));
+
+	/*
+	 * Strings that have no references left stay in the table until their
+	 * destructor takes the lock, so only those that can be retained match.
+	 */
+	if (shard->bucket_count != 0) {
+		struct refc_ref *entry = shard->buckets[hash % shard->bucket_count];
+		while (entry != NULL) {
+			struct refc_interned *interned = refc_interned_of(entry);
+			if (interned->hash == hash && interned->length == length
+					&& memcmp(interned->bytes, bytes, length) == 0
+					&& refc_count_try_retain(entry)) {
+				refc_unlock(&(shard->lock));
+				return entry;
+			}
+			entry = interned->next;
+		}
+	}
+
+	if (shard->count >= shard->bucket_count) {
+		refc_intern_grow(shard);
+	}
+	struct refc_ref *ref = NULL;
+	if (shard->bucket_count != 0) {
+		ref = refc_allocate_dtor(sizeof(struct refc_interned)
+				+ REFC_INTERNAL_SLACK(struct refc_interned) + length + 1, &refc_intern_remove);
+	}
+	if (ref != NULL) {
+		struct refc_interned *interned = refc_interned_of(ref);
+		interned->hash = hash;
+		interned->length = length;
+		memcpy(interned->bytes, bytes, length);
+		interned->bytes[length] = 0;
+		interned->next = shard->buckets[hash % shard->bucket_count];
+		shard->buckets[hash % shard->bucket_count] = ref;
+		shard->count++;
+	}
+	refc_unlock(&(shard->lock));
+	return ref;
+}
+
+const char *refc_intern_data(struct refc_ref *ref) {
+	return refc_interned_of(ref)->bytes;
+}
+
+size_t refc_intern_length(struct refc_ref *ref) {
+	return refc_interned_of(ref)->length;
+}
+
+/*
+ * A reader announces itself in the current phase before loading the
+ * reference. A writer replaces the reference, moves new readers to the
+ * other phase and waits for the readers of the previous phase to leave,
+ * after which none of them can still retain the previous reference.
+ */
+struct refc_ref *refc_atomic_slot_load_retain(struct refc_atomic_slot *slot) {
+#ifdef REFC_H_SINGLE_THREADED
+	if (slot->ref != NULL) {
+		refc_retain(slot->ref);
+	}
+	return slot->ref;
+#else
+	unsigned int phase = atomic_load(&(slot->phase));
+	for (;;) {
+		atomic_fetch_add(&(slot->readers[phase]), 1);
+		unsigned int current = atomic_load(&(slot->phase));
+		if (current == phase) {
+			break;
+		}
+		atomic_fetch_sub(&(slot->readers[phase]), 1);
+		phase = current;
+	}
+	struct refc_ref *ref = atomic_load(&(slot->ref));
+	if (ref != NULL) {
+		refc_retain(ref);
+	}
+	atomic_fetch_sub_explicit(&(slot->readers[phase]), 1, memory_order_release);
+	return ref;
+#endif
+}
+
+struct refc_ref *refc_atomic_slot_exchange(struct refc_atomic_slot *slot, struct refc_ref *ref) {
+#ifdef REFC_H_SINGLE_THREADED
+	struct refc_ref *previous = slot->ref;
+	slot->ref = ref;
+	return previous;
+#else
+	refc_lock(&(slot->lock));
+	struct refc_ref *previous = atomic_exchange(&(slot->ref), ref);
+	unsigned int phase = atomic_load_explicit(&(slot->phase), memory_order_relaxed);
+	atomic_store(&(slot->phase), phase ^ 1);
+	while (atomic_load_explicit(&(slot->readers[phase]), memory_order_acquire) != 0) {
+	}
+	refc_unlock(&(slot->lock));
+	return previous;
+#endif
+}
+
+void refc_atomic_slot_store(struct refc_atomic_slot *slot, struct refc_ref *ref) {
+	struct refc_ref *previous = refc_atomic_slot_exchange(slot, ref);
+	if (previous != NULL) {
+		refc_release(previous);
+	}
+}
+
+#ifdef REFC_H_WEAK
+struct refc_weak_ref *refc_weak_create(struct refc_ref *ref) {
+	struct refc_weak_ref *weak = atomic_load_explicit(&(ref->weak), memory_order_acquire);
+	if (weak == NULL) {
+		struct refc_weak_ref *created = malloc(sizeof(struct refc_weak_ref));
+		if (created == NULL) {
+			return NULL;
+		}
+		atomic_init(&(created->lock), 0);
+		created->target = ref;
+		atomic_init(&(created->weak_count), 2);
+		if (atomic_compare_exchange_strong_explicit(&(ref->weak), &weak, created,
+					memory_order_acq_rel, memory_order_acquire)) {
+			return created;
+		}
+		free(created);
+	}
+	atomic_fetch_add_explicit(&(weak->weak_count), 1, memory_order_relaxed);
+	return weak;
+}
+
+struct refc_ref *refc_weak_lock(struct refc_weak_ref *weak) {
+	refc_lock(&(weak->lock));
+	struct refc_ref *ref = weak->target;
+	if (ref != NULL && !refc_count_try_retain(ref)) {
+		ref = NULL;
+	}
+	refc_unlock(&(weak->lock));
+	return ref;
+}
+#endif
+
+#ifdef REFC_LINKS
+/*
+ * Held while linking, so that searches own the visited stamps and orders
+ * and so that refc_collect sees the links of blocks unchanged.
+ */
+static atomic_bool refc_links_lock;
+
+/* A growable list of blocks */
+struct refc_visit_list {
+	struct refc_ref **refs;
+	size_t count;
+	size_t capacity;
+};
+
+/* Returns 0 if the list cannot grow */
+static int refc_visit_push(struct refc_visit_list *list, struct refc_ref *ref) {
+	if (list->count == list->capacity) {
+		size_t capacity = list->capacity != 0 ? list->capacity * 2 : 64;
+		struct refc_ref **refs = realloc(list->refs, capacity * sizeof(struct refc_ref *));
+		if (refs == NULL) {
+			return 0;
+		}
+		list->refs = refs;
+		list->capacity = capacity;
+	}
+	list->refs[list->count++] = ref;
+	return 1;
+}
+
+#ifdef REFC_CYCLE_CHECK
+/*
+ * Linked blocks are kept in a topological order, every parent is ordered
+ * before its children, which is maintained with the algorithm of Pearce
+ * and Kelly. A link that agrees with the order cannot close a cycle and
+ * takes constant time. Otherwise only the blocks ordered between the
+ * child and the parent are searched and reordered.
+ *
+ * Blocks are ordered upon their first link. A new parent is ordered first
+ * and a new child last, so linking new blocks always agrees with the order.
+ */
+
+/* Lowest and highest order given out so far */
+static int64_t refc_order_first;
+static int64_t refc_order_last;
+
+/* Stamp of the current search, blocks with it were already visited */
+static size_t refc_visit_stamp;
+
+/* Blocks found by searching children and parents, reused between links */
+static struct refc_visit_list refc_visit_children;
+static struct refc_visit_list refc_visit_parents;
+
+/*
+ * Collects the blocks reachable from `from` through child links when
+ * `forward` is set or through parent links otherwise, visiting each once
+ * and without recursion. Only blocks ordered after `first` and before
+ * `last` are followed.
+ *
+ * Returns 1 if `match` is reachable, -1 if the list cannot grow, 0 otherwise.
+ */
+static int refc_visit(struct refc_visit_list *list, struct refc_ref *from, int forward,
+		int64_t first, int64_t last, struct refc_ref *match) {
+	size_t stamp = ++refc_visit_stamp;
+	list->count = 0;
+	from->visited = stamp;
+	if (!refc_visit_push(list, from)) {
+		return -1;
+	}
+	for (size_t i = 0; i < list->count; i++) {
+		struct refc_ref *ref = list->refs[i];
+		struct refc_links *links = forward ? ref->links : ref->parents;
+		for (size_t j = 0; links != NULL && j < links->count; j++) {
+			struct refc_ref *value = links->refs[j];
+			if (value->visited == stamp) {
+				continue;
+			}
+			if (value == match) {
+				return 1;
+			}
+			if (value->order <= first || value->order >= last) {
+				continue;
+			}
+			value->visited = stamp;
+			if (!refc_visit_push(list, value)) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int refc_order_compare(const void *a, const void *b) {
+	int64_t left = (*(struct refc_ref * const *) a)->order;
+	int64_t right = (*(struct refc_ref * const *) b)->order;
+	return (left > right) - (left < right);
+}
+
+/*
+ * Orders `parent` before `child` unless the child reaches the parent.
+ * Returns 1 on success, 0 for a cycle and -1 on allocation failure.
+ * Must be called with refc_links_lock held.
+ */
+static int refc_order(struct refc_ref *parent, struct refc_ref *child) {
+	if (parent->order == 0) {
+		parent->order = --refc_order_first;
+	}
+	if (child->order == 0) {
+		child->order = ++refc_order_last;
+	}
+	if (parent->order < child->order) {
+		return 1;
+	}
+
+	/* Blocks ordered between the child and the parent that must move */
+	struct refc_visit_list *children = &refc_visit_children;
+	struct refc_visit_list *parents = &refc_visit_parents;
+	int found = refc_visit(children, child, 1, child->order, parent->order + 1, parent);
+	if (found != 0) {
+		return found == 1 ? 0 : -1;
+	}
+	if (refc_visit(parents, parent, 0, child->order, parent->order + 1, NULL) != 0) {
+		return -1;
+	}
+
+	/* The parent's ancestors take the lowest of the orders, in their order */
+	size_t count = children->count + parents->count;
+	int64_t *orders = malloc(count * sizeof(int64_t));
+	if (orders == NULL) {
+		return -1;
+	}
+	qsort(parents->refs, parents->count, sizeof(struct refc_ref *), &refc_order_compare);
+	qsort(children->refs, children->count, sizeof(struct refc_ref *), &refc_order_compare);
+	for (size_t i = 0, j = 0, k = 0; k < count; k++) {
+		if (j == children->count || (i < parents->count && parents->refs[i]->order < children->refs[j]->order)) {
+			orders[k] = parents->refs[i++]->order;
+		} else {
+			orders[k] = children->refs[j++]->order;
+		}
+	}
+	for (size_t k = 0; k < count; k++) {
+		struct refc_ref *ref = k < parents->count ? parents->refs[k] : children->refs[k - parents->count];
+		ref->order = orders[k];
+	}
+	free(orders);
+	return 1;
+}
+
+#endif
+
+/* Adds a block to an array of links, returns 0 on allocation failure */
+static int refc_links_add(struct refc_links **links, struct refc_ref *ref) {
+	struct refc_links *array = *links;
+	if (array == NULL || array->count == array->capacity) {
+		size_t capacity = array != NULL ? array->capacity * 2 : 4;
+		array = realloc(array, sizeof(struct refc_links) + capacity * sizeof(struct refc_ref *));
+		if (array == NULL) {
+			return 0;
+		}
+		if (*links == NULL) {
+			array->count = 0;
+		}
+		array->capacity = capacity;
+		*links = array;
+	}
+	array->refs[array->count++] = ref;
+	return 1;
+}
+
+/*
+ * Removes a block from an array of links, shrinking it once mostly empty
+ * so that its memory follows the number of links.
+ * Returns 0 if the block is not in the array.
+ */
+static int refc_links_remove(struct refc_links **links, struct refc_ref *ref) {
+	struct refc_links *array = *links;
+	size_t i = 0;
+	while (array != NULL && i < array->count && array->refs[i] != ref) {
+		i++;
+	}
+	if (array == NULL || i == array->count) {
+		return 0;
+	}
+	array->refs[i] = array->refs[--array->count];
+	if (array->count == 0) {
+		free(array);
+		*links = NULL;
+	} else if (array->count * 4 <= array->capacity) {
+		size_t capacity = array->capacity / 2;
+		struct refc_links *shrunk = realloc(array, sizeof(struct refc_links) + capacity * sizeof(struct refc_ref *));
+		if (shrunk != NULL) {
+			shrunk->capacity = capacity;
+			*links = shrunk;
+		}
+	}
+	return 1;
+}
+
+int refc_link(struct refc_ref *parent, struct refc_ref *child) {
+#ifdef REFC_CYCLE_CHECK
     /*
-     * Remove the child from the parent's list of links.
-     * As deleting from a lock-free linked list is a tricky matter
-     * this implementation simply sets the particular node to NULL,
-     * which will not match any existing child reference.
+     * Check for linking attempt between the same block
      */
-	struct ListNode *head = atomic_load(&(parent->links));
-    while(head) {
-        if (child == atomic_load(&(head->value))) {
-            atomic_store(&(head->value), NULL);
-            return 1;
-        }
-        head = head->next;
+    if (parent == child) {
+        return 0;
     }
-    return 0;
+#endif
+
+	refc_lock(&refc_links_lock);
+#ifdef REFC_CYCLE_CHECK
+    /*
+     * Check for a cycle while ordering the parent before the child
+     */
+	if (refc_order(parent, child) != 1) {
+		refc_unlock(&refc_links_lock);
+		return 0;
+	}
+#endif
+
+    /*
+     * No cycles found, link the child and the parent to each other
+     */
+	int linked = refc_links_add(&(parent->links), child);
+	if (linked && !refc_links_add(&(child->parents), parent)) {
+		refc_links_remove(&(parent->links), child);
+		linked = 0;
+	}
+#ifdef REFC_H_COLLECT
+	if (linked) {
+		atomic_fetch_or(&(parent->collect_flags), REFC_COLLECT_LINKED);
+		atomic_fetch_or(&(child->collect_flags), REFC_COLLECT_LINKED);
+	}
+#endif
+	refc_unlock(&refc_links_lock);
+	return linked;
+}
+
+int refc_unlink(struct refc_ref *parent, struct refc_ref *child) {
+    /*
+     * Remove the child from the parent's list of links.
+     * The order of the blocks stays valid without the link.
+     */
+	refc_lock(&refc_links_lock);
+	int unlinked = refc_links_remove(&(parent->links), child);
+	if (unlinked) {
+		refc_links_remove(&(child->parents), parent);
+	}
+	refc_unlock(&refc_links_lock);
+	return unlinked;
+}
+
+/* Removes all links of a block that is about to be freed */
+static void refc_unlink_all(struct refc_ref *ref) {
+	refc_lock(&refc_links_lock);
+	for (size_t i = 0; ref->links != NULL && i < ref->links->count; i++) {
+		refc_links_remove(&(ref->links->refs[i]->parents), ref);
+	}
+	for (size_t i = 0; ref->parents != NULL && i < ref->parents->count; i++) {
+		refc_links_remove(&(ref->parents->refs[i]->links), ref);
+	}
+	free(ref->links);
+	free(ref->parents);
+	refc_unlock(&refc_links_lock);
+}
+
+#ifdef REFC_H_DEBUG
+/* Returns the reference count of a block, only an estimate while it changes */
+static size_t refc_debug_count(struct refc_ref *ref) {
+#ifdef REFC_H_SINGLE_THREADED
+	return ref->reference_count;
+#elif defined(REFC_H_BIASED)
+	intptr_t shared = atomic_load_explicit(&(ref->shared_count), memory_order_relaxed);
+	shared -= shared & (REFC_BIASED_ONE - 1);
+	return ref->biased_count + (size_t) (shared / REFC_BIASED_ONE);
+#else
+	size_t count = atomic_load_explicit(&(ref->reference_count), memory_order_relaxed);
+#ifdef REFC_H_SHARDED
+	if (ref->shards != NULL) {
+		for (size_t i = 0; i < REFC_H_COUNT_SHARDS; i++) {
+			intptr_t shard = atomic_load_explicit(&(ref->shards->shard[i].count), memory_order_relaxed);
+			if (shard >= REFC_SHARD_FOLDED / 2) {
+				count += (size_t) shard;
+			}
+		}
+	}
+#endif
+	return count;
+#endif
+}
+
+size_t refc_debug_report(void) {
+	size_t reported = 0;
+	for (size_t i = 0; i < REFC_DEBUG_SHARDS; i++) {
+		struct refc_debug_shard *shard = &refc_debug_shards[i];
+		refc_lock(&shard->lock);
+		for (struct refc_ref *ref = shard->head; ref != NULL; ref = ref->live_next) {
+			const char *name = ref->type != 0 ? refc_types[ref->type - 1].name : NULL;
+			void (*destructor)(void *) = ref->type != 0 ? refc_types[ref->type - 1].destructor : NULL;
+			fprintf(stderr, "refc: block %p of %zu bytes with %zu references, type %s, destructor %p\n",
+					(void *) ref->block, ref->size, refc_debug_count(ref),
+					name != NULL ? name : "(none)", (void *) destructor);
+			refc_lock(&refc_links_lock);
+			for (size_t j = 0; ref->links != NULL && j < ref->links->count; j++) {
+				fprintf(stderr, "refc:     links to %p\n", (void *) ref->links->refs[j]->block);
+			}
+			refc_unlock(&refc_links_lock);
+			reported++;
+		}
+		refc_unlock(&shard->lock);
+	}
+	if (reported > 0) {
+		fprintf(stderr, "refc: %zu blocks not freed\n", reported);
+	}
+	return reported;
+}
+
+static void refc_debug_report_exit(void) {
+	refc_debug_report();
+}
+
+int refc_debug_report_at_exit(void) {
+	return atexit(&refc_debug_report_exit) == 0;
+}
+#endif
+
+#ifdef REFC_H_COLLECT
+/*
+ * The synchronous cycle collector of Bacon and Rajan. Blocks that are
+ * released without reaching a reference count of 0 are buffered as
+ * possible roots of garbage cycles. Collecting removes the references
+ * of links from the counts of the blocks reachable from the roots,
+ * restores them for the blocks that are left with references and
+ * reclaims the rest. The traversals use stacks linked through the
+ * blocks, so collecting never fails for lack of memory.
+ */
+
+/* Possible roots of garbage cycles */
+static struct refc_visit_list refc_roots;
+
+/* References that garbage blocks are left with while being reclaimed */
+#define REFC_COLLECT_SENTINEL (((refc_count_value) -1) / 2)
+
+static refc_count_value refc_collect_count(struct refc_ref *ref) {
+#ifdef REFC_H_SINGLE_THREADED
+	return ref->reference_count;
+#else
+	return atomic_load_explicit(&(ref->reference_count), memory_order_relaxed);
+#endif
+}
+
+/* Adds the reference of a link to a block or removes it */
+static void refc_collect_adjust(struct refc_ref *ref, int add) {
+#ifdef REFC_H_SINGLE_THREADED
+	ref->reference_count = add ? ref->reference_count + 1 : ref->reference_count - 1;
+#else
+	if (add) {
+		atomic_fetch_add_explicit(&(ref->reference_count), 1, memory_order_relaxed);
+	} else {
+		atomic_fetch_sub_explicit(&(ref->reference_count), 1, memory_order_relaxed);
+	}
+#endif
+}
+
+/* Buffers a linked block that is about to be released without reaching 0 */
+static void refc_collect_candidate(struct refc_ref *ref, size_t n) {
+	unsigned char flags = atomic_load_explicit(&(ref->collect_flags), memory_order_relaxed);
+	if (flags != REFC_COLLECT_LINKED || refc_collect_count(ref) <= n) {
+		return;
+	}
+	refc_lock(&refc_links_lock);
+	if (atomic_load_explicit(&(ref->collect_flags), memory_order_relaxed) == REFC_COLLECT_LINKED
+			&& refc_visit_push(&refc_roots, ref)) {
+		ref->root = refc_roots.count - 1;
+		ref->color = REFC_PURPLE;
+		atomic_fetch_or_explicit(&(ref->collect_flags), REFC_COLLECT_BUFFERED, memory_order_relaxed);
+	}
+	refc_unlock(&refc_links_lock);
+}
+
+/* Unbuffers a block that reached a reference count of 0 */
+static void refc_collect_forget(struct refc_ref *ref) {
+	if (!(atomic_load_explicit(&(ref->collect_flags), memory_order_relaxed) & REFC_COLLECT_BUFFERED)) {
+		return;
+	}
+	refc_lock(&refc_links_lock);
+	struct refc_ref *last = refc_roots.refs[--refc_roots.count];
+	refc_roots.refs[ref->root] = last;
+	last->root = ref->root;
+	atomic_fetch_and_explicit(&(ref->collect_flags), ~REFC_COLLECT_BUFFERED, memory_order_relaxed);
+	refc_unlock(&refc_links_lock);
+}
+
+/* Removes the references of links from the blocks reachable from `ref` */
+static void refc_collect_mark_gray(struct refc_ref *ref) {
+	ref->color = REFC_GRAY;
+	ref->collect_next = NULL;
+	struct refc_ref *stack = ref;
+	while (stack != NULL) {
+		struct refc_ref *next = stack;
+		stack = next->collect_next;
+		for (size_t i = 0; next->links != NULL && i < next->links->count; i++) {
+			struct refc_ref *child = next->links->refs[i];
+			refc_collect_adjust(child, 0);
+			if (child->color != REFC_GRAY) {
+				child->color = REFC_GRAY;
+				child->collect_next = stack;
+				stack = child;
+			}
+		}
+	}
 }
+
+/* Restores the references of links to the blocks reachable from `ref` */
+static void refc_collect_scan_black(struct refc_ref *ref) {
+	ref->color = REFC_BLACK;
+	ref->collect_black_next = NULL;
+	struct refc_ref *stack = ref;
+	while (stack != NULL) {
+		struct refc_ref *next = stack;
+		stack = next->collect_black_next;
+		for (size_t i = 0; next->links != NULL && i < next->links->count; i++) {
+			struct refc_ref *child = next->links->refs[i];
+			refc_collect_adjust(child, 1);
+			if (child->color != REFC_BLACK) {
+				child->color = REFC_BLACK;
+				child->collect_black_next = stack;
+				stack = child;
+			}
+		}
+	}
+}
+
+/*
+ * Colors the gray blocks reachable from `ref` white if they have no
+ * references left, restoring the blocks reachable from the others.
+ */
+static void refc_collect_scan(struct refc_ref *ref) {
+	if (ref->color != REFC_GRAY) {
+		return;
+	}
+	/* Pushed blocks are white until their count is checked */
+	ref->color = REFC_WHITE;
+	ref->collect_next = NULL;
+	struct refc_ref *stack = ref;
+	while (stack != NULL) {
+		struct refc_ref *next = stack;
+		stack = next->collect_next;
+		if (next->color != REFC_WHITE) {
+			continue;
+		}
+		if (refc_collect_count(next) > 0) {
+			refc_collect_scan_black(next);
+			continue;
+		}
+		for (size_t i = 0; next->links != NULL && i < next->links->count; i++) {
+			struct refc_ref *child = next->links->refs[i];
+			if (child->color == REFC_GRAY) {
+				child->color = REFC_WHITE;
+				child->collect_next = stack;
+				stack = child;
+			}
+		}
+	}
+}
+
+/* Prepends the white blocks reachable from `ref` to `garbage` */
+static struct refc_ref *refc_collect_white(struct refc_ref *ref, struct refc_ref *garbage) {
+	if (ref->color != REFC_WHITE) {
+		return garbage;
+	}
+	ref->color = REFC_BLACK;
+	ref->collect_next = NULL;
+	struct refc_ref *stack = ref;
+	while (stack != NULL) {
+		struct refc_ref *next = stack;
+		stack = next->collect_next;
+		for (size_t i = 0; next->links != NULL && i < next->links->count; i++) {
+			struct refc_ref *child = next->links->refs[i];
+			if (child->color == REFC_WHITE) {
+				child->color = REFC_BLACK;
+				child->collect_next = stack;
+				stack = child;
+			}
+		}
+		next->collect_next = garbage;
+		garbage = next;
+	}
+	return garbage;
+}
+
+size_t refc_collect(void) {
+#ifdef REFC_H_EPOCH
+	/* Retired blocks still hold their children until they are reclaimed */
+	refc_epoch_synchronize();
+#endif
+	refc_lock(&refc_links_lock);
+	size_t roots = 0;
+	for (size_t i = 0; i < refc_roots.count; i++) {
+		struct refc_ref *ref = refc_roots.refs[i];
+		if (ref->color == REFC_PURPLE) {
+			refc_collect_mark_gray(ref);
+			ref->root = roots;
+			refc_roots.refs[roots++] = ref;
+		} else {
+			atomic_fetch_and_explicit(&(ref->collect_flags), ~REFC_COLLECT_BUFFERED, memory_order_relaxed);
+		}
+	}
+	refc_roots.count = roots;
+	for (size_t i = 0; i < roots; i++) {
+		refc_collect_scan(refc_roots.refs[i]);
+	}
+	for (size_t i = 0; i < roots; i++) {
+		atomic_fetch_and_explicit(&(refc_roots.refs[i]->collect_flags), ~REFC_COLLECT_BUFFERED, memory_order_relaxed);
+	}
+	struct refc_ref *garbage = NULL;
+	for (size_t i = 0; i < roots; i++) {
+		garbage = refc_collect_white(refc_roots.refs[i], garbage);
+	}
+	refc_roots.count = 0;
+
+	/* Releases by the destructors of garbage blocks never reach 0 */
+	for (struct refc_ref *ref = garbage; ref != NULL; ref = ref->collect_next) {
+#ifdef REFC_H_SINGLE_THREADED
+		ref->reference_count = REFC_COLLECT_SENTINEL;
+#else
+		atomic_store_explicit(&(ref->reference_count), REFC_COLLECT_SENTINEL, memory_order_relaxed);
+#endif
+		atomic_fetch_or_explicit(&(ref->collect_flags), REFC_COLLECT_RECLAIMED, memory_order_relaxed);
+	}
+	/* Live children are released by the destructors, restore their link references */
+	for (struct refc_ref *ref = garbage; ref != NULL; ref = ref->collect_next) {
+		for (size_t i = 0; ref->links != NULL && i < ref->links->count; i++) {
+			struct refc_ref *child = ref->links->refs[i];
+			if (!(atomic_load_explicit(&(child->collect_flags), memory_order_relaxed) & REFC_COLLECT_RECLAIMED)) {
+				refc_collect_adjust(child, 1);
+			}
+		}
+	}
+	refc_unlock(&refc_links_lock);
+
+#ifdef REFC_H_EPOCH
+	/* Garbage blocks can still be borrowed by threads that are in an epoch */
+	if (garbage != NULL) {
+		refc_epoch_synchronize();
+	}
+#endif
+	for (struct refc_ref *ref = garbage; ref != NULL; ref = ref->collect_next) {
+		refc_destruct(ref);
+	}
+	size_t collected = 0;
+	while (garbage != NULL) {
+		struct refc_ref *next = garbage->collect_next;
+		refc_free(garbage);
+		collected++;
+		garbage = next;
+	}
+	return collected;
+}
+#endif
 #endif
 
 #endif /* REFC_H_IMPLEMENTATION */
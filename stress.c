@@ -0,0 +1,331 @@
+/*
+ * Stress test for refc.h
+ *
+ * Threads share blocks and retain, release, link and unlink them at random,
+ * checking that every destructor runs exactly once and sees the writes that
+ * all threads made to the block before releasing it. Further phases release
+ * blocks whose allocating thread exited, and replace and load an atomic
+ * slot. Meant to be run under the sanitizers:
+ *
+ * Build with: cc -std=c11 -O1 -g -fsanitize=thread stress.c -o stress -lpthread
+ *        or:  cc -std=c11 -O1 -g -fsanitize=address,undefined stress.c -o stress -lpthread
+ * Run with:   ./stress [threads] [rounds]
+ */
+
+#define REFC_H_IMPLEMENTATION
+#include "refc.h"
+
+#ifdef REFC_H_SINGLE_THREADED
+#error "stress.c shares blocks between threads"
+#endif
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_THREADS 64
+
+/* Blocks shared by all threads in each round */
+#define BLOCKS 64
+
+/* Operations made by each thread in each round */
+#define OPERATIONS 20000
+
+#define LIVE 0x4c495645u
+#define DEAD 0x44454144u
+
+struct payload {
+	unsigned int magic;
+	size_t id;
+
+	/* Set by each thread before it releases its last reference */
+	unsigned char done[MAX_THREADS];
+};
+
+static size_t threads;
+
+/* Destructor calls of each block of the current round */
+static atomic_uint destructed[BLOCKS];
+
+/* Blocks of the orphan phase, allocated by a thread that exits before they are released */
+#define ORPHANS 4096
+static struct refc_ref *orphans[ORPHANS];
+static atomic_size_t orphan_destructed;
+
+/* Blocks allocated and destructed by the slot phase */
+static atomic_size_t slot_allocated;
+static atomic_size_t slot_destructed;
+
+static void shared_dtor(void *block) {
+	struct payload *payload = block;
+	assert(payload->magic == LIVE);
+	for (size_t i = 0; i < threads; i++) {
+		/* Ordered by the decrements of the reference count */
+		assert(payload->done[i]);
+	}
+	payload->magic = DEAD;
+	assert(atomic_fetch_add(&destructed[payload->id], 1) == 0);
+}
+
+static void orphan_dtor(void *block) {
+	struct payload *payload = block;
+	assert(payload->magic == LIVE);
+	payload->magic = DEAD;
+	atomic_fetch_add(&orphan_destructed, 1);
+}
+
+static void slot_dtor(void *block) {
+	struct payload *payload = block;
+	assert(payload->magic == LIVE);
+	payload->magic = DEAD;
+	atomic_fetch_add(&slot_destructed, 1);
+}
+
+/* Disposes of deferred blocks, and of blocks queued for their owner */
+static void settle(void) {
+#ifdef REFC_H_BIASED
+	refc_release(refc_allocate(16));
+#endif
+#if defined(REFC_H_EPOCH) && defined(REFC_H_DEFERRED)
+	do {
+		refc_epoch_synchronize();
+	} while (refc_drain((size_t) -1) > 0);
+#elif defined(REFC_H_EPOCH)
+	refc_epoch_synchronize();
+#elif defined(REFC_H_DEFERRED)
+	refc_drain((size_t) -1);
+#endif
+}
+
+static unsigned int next_random(unsigned int *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+struct worker {
+	size_t index;
+	struct refc_ref **blocks;
+#ifdef REFC_H_WEAK
+	struct refc_weak_ref **weak;
+#endif
+	struct refc_atomic_slot *slot;
+};
+
+/* Each thread owns one reference to every shared block */
+static void *shared_thread(void *arg) {
+	struct worker *w = arg;
+	unsigned int state = (unsigned int) w->index * 2654435761u + 1;
+	for (size_t op = 0; op < OPERATIONS; op++) {
+		struct refc_ref *ref = w->blocks[next_random(&state) % BLOCKS];
+		switch (next_random(&state) % 5) {
+		case 0:
+			refc_retain(ref);
+			assert(((struct payload *) refc_access(ref))->magic == LIVE);
+			refc_release(ref);
+			break;
+		case 1: {
+			size_t n = next_random(&state) % 4 + 1;
+			refc_retain_n(ref, n);
+			refc_release_n(ref, n);
+			break;
+		}
+		case 2: {
+			struct refc_ref *refs[4];
+			for (size_t i = 0; i < 4; i++) {
+				refs[i] = w->blocks[next_random(&state) % BLOCKS];
+				refc_retain(refs[i]);
+			}
+			refc_release_array(refs, 4);
+			break;
+		}
+		case 3: {
+#if defined(REFC_H_DEBUG) || defined(REFC_H_COLLECT)
+			/* Both blocks are owned by this thread while they are linked */
+			struct refc_ref *child = w->blocks[next_random(&state) % BLOCKS];
+			if (refc_link(ref, child)) {
+				refc_unlink(ref, child);
+			}
+#endif
+			break;
+		}
+		case 4:
+#ifdef REFC_H_WEAK
+		{
+			struct refc_ref *locked = refc_weak_lock(w->weak[next_random(&state) % BLOCKS]);
+			assert(locked != NULL);
+			assert(((struct payload *) refc_access(locked))->magic == LIVE);
+			refc_release(locked);
+		}
+#endif
+			break;
+		}
+	}
+
+	/* Release the owned references in an order of this thread's own */
+	size_t start = next_random(&state) % BLOCKS;
+	for (size_t i = 0; i < BLOCKS; i++) {
+		struct refc_ref *ref = w->blocks[(start + i) % BLOCKS];
+		((struct payload *) refc_access(ref))->done[w->index] = 1;
+#ifdef REFC_H_SHARDED
+		/* Every thread unshards, the first one folds while the others use the shards */
+		refc_unshard(ref);
+#endif
+		refc_release(ref);
+	}
+	settle();
+	return NULL;
+}
+
+/* Allocates the orphans with a reference for each thread, then exits */
+static void *orphan_allocate_thread(void *arg) {
+	(void) arg;
+	for (size_t i = 0; i < ORPHANS; i++) {
+		orphans[i] = refc_allocate_dtor(sizeof(struct payload), &orphan_dtor);
+		assert(orphans[i] != NULL);
+		((struct payload *) refc_access(orphans[i]))->magic = LIVE;
+		refc_retain_n(orphans[i], threads - 1);
+	}
+	return NULL;
+}
+
+/*
+ * Releases the references of this thread to the orphans. With
+ * REFC_H_BIASED their counts are biased to the exited thread, so the
+ * releases race to queue them for a record that no thread owns.
+ */
+static void *orphan_thread(void *arg) {
+	(void) arg;
+	for (size_t i = 0; i < ORPHANS; i++) {
+		refc_retain(orphans[i]);
+		assert(((struct payload *) refc_access(orphans[i]))->magic == LIVE);
+		refc_release(orphans[i]);
+		refc_release(orphans[i]);
+	}
+	settle();
+	return NULL;
+}
+
+static struct refc_ref *slot_allocate(void) {
+	struct refc_ref *ref = refc_allocate_dtor(sizeof(struct payload), &slot_dtor);
+	assert(ref != NULL);
+	((struct payload *) refc_access(ref))->magic = LIVE;
+	atomic_fetch_add(&slot_allocated, 1);
+	return ref;
+}
+
+/* Loads the shared slot while replacing its block now and then */
+static void *slot_thread(void *arg) {
+	struct worker *w = arg;
+	unsigned int state = (unsigned int) w->index * 2654435761u + 7;
+	for (size_t op = 0; op < OPERATIONS; op++) {
+		if (next_random(&state) % 16 == 0) {
+			refc_atomic_slot_store(w->slot, slot_allocate());
+		} else {
+			struct refc_ref *ref = refc_atomic_slot_load_retain(w->slot);
+			assert(ref != NULL);
+			assert(((struct payload *) refc_access(ref))->magic == LIVE);
+			refc_release(ref);
+		}
+	}
+	settle();
+	return NULL;
+}
+
+static void run(void *(*body)(void *), struct worker *workers) {
+	pthread_t ids[MAX_THREADS];
+	for (size_t i = 0; i < threads; i++) {
+		assert(pthread_create(&ids[i], NULL, body, &workers[i]) == 0);
+	}
+	for (size_t i = 0; i < threads; i++) {
+		assert(pthread_join(ids[i], NULL) == 0);
+	}
+	settle();
+}
+
+int main(int argc, char **argv) {
+	threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 8;
+	size_t rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 20;
+	if (threads < 1 || threads > MAX_THREADS) {
+		fprintf(stderr, "threads must be between 1 and %d\n", MAX_THREADS);
+		return 1;
+	}
+
+	struct worker workers[MAX_THREADS];
+	struct refc_ref *blocks[BLOCKS];
+#ifdef REFC_H_WEAK
+	struct refc_weak_ref *weak[BLOCKS];
+#endif
+	for (size_t round = 0; round < rounds; round++) {
+		for (size_t i = 0; i < BLOCKS; i++) {
+#ifdef REFC_H_SHARDED
+			blocks[i] = refc_allocate_flags(sizeof(struct payload), &shared_dtor,
+					i % 2 ? REFC_ALLOCATE_SHARDED : 0);
+#else
+			blocks[i] = refc_allocate_dtor(sizeof(struct payload), &shared_dtor);
+#endif
+			assert(blocks[i] != NULL);
+			struct payload *payload = refc_access(blocks[i]);
+			payload->magic = LIVE;
+			payload->id = i;
+			for (size_t j = 0; j < MAX_THREADS; j++) {
+				payload->done[j] = 0;
+			}
+			atomic_store(&destructed[i], 0);
+#ifdef REFC_H_WEAK
+			weak[i] = refc_weak_create(blocks[i]);
+			assert(weak[i] != NULL);
+#endif
+			/* One reference for each thread, the first replaces the allocating one */
+			refc_retain_n(blocks[i], threads - 1);
+		}
+		for (size_t i = 0; i < threads; i++) {
+			workers[i] = (struct worker) { .index = i, .blocks = blocks };
+#ifdef REFC_H_WEAK
+			workers[i].weak = weak;
+#endif
+		}
+		run(&shared_thread, workers);
+
+		for (size_t i = 0; i < BLOCKS; i++) {
+			assert(atomic_load(&destructed[i]) == 1);
+#ifdef REFC_H_WEAK
+			assert(refc_weak_lock(weak[i]) == NULL);
+			refc_weak_release(weak[i]);
+#endif
+		}
+#ifdef REFC_H_COLLECT
+		/* Every link was removed again, no cycles are left */
+		assert(refc_collect() == 0);
+#endif
+	}
+	printf("shared blocks: %zu rounds of %zu threads ok\n", rounds, threads);
+
+	for (size_t round = 0; round < rounds; round++) {
+		pthread_t allocator;
+		assert(pthread_create(&allocator, NULL, &orphan_allocate_thread, NULL) == 0);
+		assert(pthread_join(allocator, NULL) == 0);
+		for (size_t i = 0; i < threads; i++) {
+			workers[i] = (struct worker) { .index = i };
+		}
+		run(&orphan_thread, workers);
+		assert(atomic_load(&orphan_destructed) == (round + 1) * ORPHANS);
+	}
+	printf("orphaned blocks: %zu rounds ok\n", rounds);
+
+	struct refc_atomic_slot slot = { 0 };
+	refc_atomic_slot_store(&slot, slot_allocate());
+	for (size_t round = 0; round < rounds; round++) {
+		for (size_t i = 0; i < threads; i++) {
+			workers[i] = (struct worker) { .index = i, .slot = &slot };
+		}
+		run(&slot_thread, workers);
+	}
+	refc_atomic_slot_store(&slot, NULL);
+	settle();
+	assert(atomic_load(&slot_destructed) == atomic_load(&slot_allocated));
+	printf("atomic slot: %zu blocks ok\n", atomic_load(&slot_allocated));
+	return 0;
+}
@@ -1,9 +1,107 @@
 
 #define REFC_H_IMPLEMENTATION
+/*
+ * Cycles are collected instead of rejected with REFC_H_COLLECT.
+ * TESTS_NO_DEBUG tests the header layouts without the fields of REFC_H_DEBUG.
+ */
+#if !defined(REFC_H_COLLECT) && !defined(TESTS_NO_DEBUG)
 #define REFC_H_DEBUG
+#endif
 #include "refc.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Disposes of deferred blocks so that the checks below hold in any mode */
+void drain(void) {
+#if defined(REFC_H_EPOCH) && defined(REFC_H_DEFERRED)
+	do {
+		refc_epoch_synchronize();
+	} while (refc_drain((size_t) -1) > 0);
+#elif defined(REFC_H_EPOCH)
+	refc_epoch_synchronize();
+#elif defined(REFC_H_DEFERRED)
+	refc_drain((size_t) -1);
+#endif
+}
+
+int dtor_count = 0;
+
+void counting_dtor(void *ref) {
+	dtor_count++;
+}
+
+/* Releases the child reference stored in the block */
+void release_child(void *block) {
+	struct refc_ref *child = *(struct refc_ref **) block;
+	if (child != NULL) {
+		refc_release(child);
+	}
+	dtor_count++;
+}
+
+/* Releases the child reference stored in the block with refc_release_array */
+void release_child_array(void *block) {
+	struct refc_ref **child = block;
+	refc_release_array(child, *child != NULL);
+	dtor_count++;
+}
+
+/* Releases both child references stored in the block */
+void release_children(void *block) {
+	struct refc_ref **children = block;
+	for (size_t i = 0; i < 2; i++) {
+		if (children[i] != NULL) {
+			refc_release(children[i]);
+		}
+	}
+	dtor_count++;
+}
+
+#ifdef REFC_H_PROFILE
+/* Copies the site of the "tests" tag */
+void find_site(void *context, const struct refc_profile_site *site) {
+	if (site->tag != NULL && strcmp(site->tag, "tests") == 0) {
+		*(struct refc_profile_site *) context = *site;
+	}
+}
+#endif
+
+int allocations = 0;
+
+void *counting_allocate(void *context, size_t size) {
+	assert(context == &allocations);
+	allocations++;
+	return malloc(size);
+}
+
+void counting_free(void *context, void *ptr) {
+	assert(context == &allocations);
+	allocations--;
+	free(ptr);
+}
+
+#ifndef REFC_H_SINGLE_THREADED
+void *release_thread(void *ref) {
+	refc_release(ref);
+	return NULL;
+}
+
+/* Loads the slot until it holds a block with a value of -1 */
+void *load_slot_thread(void *slot) {
+	for (;;) {
+		struct refc_ref *ref = refc_atomic_slot_load_retain(slot);
+		int value;
+		memcpy(&value, refc_access(ref), sizeof(value));
+		refc_release(ref);
+		if (value == -1) {
+			return NULL;
+		}
+	}
+}
+#endif
 
 int dtor_called = 0;
 
@@ -11,18 +109,50 @@ void dtor(void *ref) {
 	dtor_called = 1;
 }
 
+int unwrapped = 0;
+
+void unwrap(void *context, void *data, size_t length) {
+	assert(context == &unwrapped && length == 4);
+	unwrapped++;
+}
+
+/* A user-allocated object with an embedded reference count */
+struct embedded {
+	int value;
+	struct refc_header header;
+};
+
+void release_embedded(struct refc_header *header) {
+	struct embedded *object = (struct embedded *)
+		((char *) header - offsetof(struct embedded, header));
+	object->value = 0;
+	dtor_called = 1;
+}
+
 int main() {
 	struct refc_ref *ref = refc_allocate_dtor(512, &dtor);
 	assert(ref != NULL);
 
 	void *block = refc_access(ref);
 	assert(block != NULL);
+	assert((uintptr_t) block % REFC_H_ALIGN == 0);
 
 	refc_release(ref);
 
+	drain();
 	assert(dtor_called == 1);
 
+	/* Consecutive blocks of every size are aligned */
+	struct refc_ref *aligned[64];
+	for (size_t i = 0; i < 64; i++) {
+		aligned[i] = refc_allocate(i * 7 + 1);
+		assert((uintptr_t) refc_access(aligned[i]) % REFC_H_ALIGN == 0);
+	}
+	for (size_t i = 0; i < 64; i++) {
+		refc_release(aligned[i]);
+	}
 
+#if defined(REFC_H_DEBUG) && !defined(REFC_H_COLLECT)
 	struct refc_ref *parent = refc_allocate(512);
 	struct refc_ref *child = refc_allocate(512);
 	assert(refc_link(parent, child));
@@ -52,4 +182,641 @@ int main() {
 	struct refc_ref *node = refc_allocate(512);
 	assert(refc_link(node, node) == 0);
 	refc_release(node);
+
+	/* Shared children are visited once, 2^32 paths lead to the last layer */
+	struct refc_ref *layers[33][2];
+	for (size_t i = 0; i < 33; i++) {
+		for (size_t j = 0; j < 2; j++) {
+			layers[i][j] = refc_allocate(8);
+			if (i > 0) {
+				assert(refc_link(layers[i - 1][0], layers[i][j]));
+				assert(refc_link(layers[i - 1][1], layers[i][j]));
+			}
+		}
+	}
+	assert(refc_link(layers[32][1], layers[0][0]) == 0);
+	assert(refc_link(layers[0][0], layers[32][1]));
+	for (size_t i = 0; i < 33; i++) {
+		refc_release(layers[i][0]);
+		refc_release(layers[i][1]);
+	}
+
+	/* Links against the order of blocks reorder them and still find cycles */
+	struct refc_ref *late_grandchild = refc_allocate(8);
+	struct refc_ref *late_child = refc_allocate(8);
+	struct refc_ref *late_grandparent = refc_allocate(8);
+	assert(refc_link(late_child, late_grandchild));
+	struct refc_ref *late_parent = refc_allocate(8);
+	assert(refc_link(late_grandparent, late_parent));
+	assert(refc_link(late_parent, late_child));
+	assert(refc_link(late_grandchild, late_grandparent) == 0);
+	assert(refc_link(late_grandchild, late_parent) == 0);
+	assert(refc_unlink(late_parent, late_child));
+	assert(refc_link(late_grandchild, late_parent));
+	refc_release(late_grandchild);
+	refc_release(late_child);
+	refc_release(late_parent);
+	refc_release(late_grandparent);
+
+	/* Unlinked and freed blocks leave the links of their neighbours */
+	struct refc_ref *owner = refc_allocate(8);
+	for (size_t i = 0; i < 100000; i++) {
+		struct refc_ref *churn = refc_allocate(8);
+		assert(refc_link(owner, churn));
+		if (i % 2 == 0) {
+			assert(refc_unlink(owner, churn));
+			assert(refc_unlink(owner, churn) == 0);
+		}
+		refc_release(churn);
+	}
+	drain();
+	assert(owner->links == NULL);
+	refc_release(owner);
+
+	/* Cycle checks do not recurse */
+	static struct refc_ref *chain_nodes[100000];
+	for (size_t i = 0; i < 100000; i++) {
+		chain_nodes[i] = refc_allocate(8);
+		if (i > 0) {
+			assert(refc_link(chain_nodes[i - 1], chain_nodes[i]));
+		}
+	}
+	assert(refc_link(chain_nodes[99999], chain_nodes[0]) == 0);
+	assert(refc_unlink(chain_nodes[49999], chain_nodes[50000]));
+	assert(refc_link(chain_nodes[99999], chain_nodes[0]));
+	for (size_t i = 0; i < 100000; i++) {
+		refc_release(chain_nodes[i]);
+	}
+	drain();
+#endif
+
+	dtor_called = 0;
+	struct refc_ref *fanout = refc_allocate_dtor(512, &dtor);
+	refc_retain_n(fanout, 3);
+	refc_release_n(fanout, 3);
+	assert(dtor_called == 0);
+	refc_release_n(fanout, 1);
+	drain();
+	assert(dtor_called == 1);
+
+	/* Typed blocks have the size and destructor of their type */
+	refc_type_id point = refc_register_type(&counting_dtor, 24, "point");
+	assert(point != 0);
+	assert(refc_register_type(NULL, 8, NULL) != point);
+	dtor_count = 0;
+	struct refc_ref *typed = refc_allocate_typed(point);
+	assert(typed != NULL);
+	assert(refc_type_of(typed) == point);
+	assert(refc_allocate_typed(0) == NULL);
+	assert(refc_allocate_typed(REFC_H_MAX_TYPES) == NULL);
+	assert(strcmp(refc_type_name(point), "point") == 0);
+	memset(refc_access(typed), 0, 24);
+	refc_release(typed);
+	drain();
+	assert(dtor_count == 1);
+
+	/* Blocks sharing a destructor share an anonymous type */
+	struct refc_ref *first = refc_allocate_dtor(16, &dtor);
+	struct refc_ref *second = refc_allocate_dtor(32, &dtor);
+	assert(refc_type_of(first) == refc_type_of(second));
+	assert(refc_type_of(first) != point);
+	assert(refc_type_name(refc_type_of(first)) == NULL);
+	struct refc_ref *untyped = refc_allocate(8);
+	assert(refc_type_of(untyped) == 0);
+	refc_release(untyped);
+	refc_release(first);
+	refc_release(second);
+	drain();
+
+	/* Only blocks that reach a count of 0 are disposed of */
+	dtor_count = 0;
+	struct refc_ref *refs[100];
+	for (size_t i = 0; i < 100; i++) {
+		refs[i] = refc_allocate_dtor(64, &counting_dtor);
+		if (i % 3 == 0) {
+			refc_retain(refs[i]);
+		}
+	}
+	refc_release_array(refs, 100);
+	drain();
+	assert(dtor_count == 66);
+	for (size_t i = 0; i < 100; i += 3) {
+		refc_release(refs[i]);
+	}
+	drain();
+	assert(dtor_count == 100);
+
+	struct refc_allocator counting = { counting_allocate, counting_free, &allocations };
+	dtor_called = 0;
+	struct refc_ref *custom = refc_allocate_ex(512, &dtor, &counting);
+	assert(custom != NULL);
+	assert(allocations == 1);
+	refc_release(custom);
+	drain();
+	assert(dtor_called == 1);
+	assert(allocations == 0);
+
+	/* Blocks are freed by the allocator they came from */
+	refc_set_allocator(&counting);
+	custom = refc_allocate(512);
+	refc_set_allocator(NULL);
+	struct refc_ref *builtin = refc_allocate(512);
+	assert(allocations == 1);
+	refc_release(custom);
+	refc_release(builtin);
+	drain();
+	assert(allocations == 0);
+
+#ifndef REFC_H_SINGLE_THREADED
+	/* References released on other threads */
+	dtor_called = 0;
+	struct refc_ref *shared = refc_allocate_dtor(512, &dtor);
+	refc_retain(shared);
+	refc_retain(shared);
+	pthread_t releaser;
+	assert(pthread_create(&releaser, NULL, release_thread, shared) == 0);
+	assert(pthread_join(releaser, NULL) == 0);
+	assert(pthread_create(&releaser, NULL, release_thread, shared) == 0);
+	assert(pthread_join(releaser, NULL) == 0);
+	assert(dtor_called == 0);
+	refc_release(shared);
+	drain();
+	assert(dtor_called == 1);
+
+	/* The last reference released on another thread */
+	dtor_called = 0;
+	shared = refc_allocate_dtor(512, &dtor);
+	refc_retain(shared);
+	refc_release(shared);
+	refc_retain(shared);
+	refc_release(shared);
+	assert(dtor_called == 0);
+	assert(pthread_create(&releaser, NULL, release_thread, shared) == 0);
+	assert(pthread_join(releaser, NULL) == 0);
+#ifdef REFC_H_BIASED
+	/* Biased counts are merged by the owning thread, on its next release */
+	assert(dtor_called == 0);
+	refc_release(refc_allocate(16));
+#endif
+	drain();
+	assert(dtor_called == 1);
+#endif
+
+	/* Embedded headers call their release callback instead of freeing */
+	dtor_called = 0;
+	struct embedded embedded = {.value = 42};
+	refc_init(&embedded.header, &release_embedded);
+	refc_header_retain(&embedded.header);
+	refc_header_release(&embedded.header);
+	assert(dtor_called == 0 && embedded.value == 42);
+	refc_header_release(&embedded.header);
+	assert(dtor_called == 1 && embedded.value == 0);
+
+	/* Slices share the bytes of a buffer and keep them alive */
+	struct refc_ref *frame = refc_buf_allocate(16);
+	assert(frame != NULL && refc_buf_length(frame) == 16);
+	memcpy(refc_buf_data(frame), "headerpayload...", 16);
+	struct refc_ref *payload = refc_buf_slice(frame, 6, 7);
+	assert(refc_buf_slice(frame, 10, 7) == NULL);
+	assert(refc_buf_slice(frame, 17, 0) == NULL);
+	refc_release(frame);
+	struct refc_ref *word = refc_buf_slice(payload, 3, 4);
+	refc_release(payload);
+	assert(refc_buf_length(word) == 4);
+	assert(memcmp(refc_buf_data(word), "load", 4) == 0);
+	refc_release(word);
+
+	/* Wrapped memory is handed back once no buffer references it */
+	char external[4] = "wrap";
+	struct refc_ref *wrapped = refc_buf_wrap(external, 4, &unwrap, &unwrapped);
+	struct refc_ref *suffix = refc_buf_slice(wrapped, 2, 2);
+	assert(refc_buf_data(suffix) == external + 2);
+	refc_release(wrapped);
+	drain();
+	assert(unwrapped == 0);
+	refc_release(suffix);
+	drain();
+	assert(unwrapped == 1);
+
+	/* Interned bytes are shared until their last reference is released */
+	struct refc_ref *key = refc_intern("key", 3);
+	assert(key != NULL && refc_intern_length(key) == 3);
+	assert(strcmp(refc_intern_data(key), "key") == 0);
+	assert(refc_intern("key", 3) == key);
+	struct refc_ref *prefix = refc_intern("key", 2);
+	assert(prefix != key);
+	refc_release(prefix);
+	refc_release(key);
+	refc_release(key);
+	drain();
+	struct refc_ref *keys[1000];
+	for (size_t i = 0; i < 1000; i++) {
+		keys[i] = refc_intern(&i, sizeof(i));
+	}
+	for (size_t i = 0; i < 1000; i++) {
+		assert(refc_intern(&i, sizeof(i)) == keys[i]);
+		refc_release(keys[i]);
+		refc_release(keys[i]);
+	}
+	drain();
+
+	/* Slots hand out retained references while they are replaced */
+	struct refc_atomic_slot slot = {0};
+	assert(refc_atomic_slot_load_retain(&slot) == NULL);
+	struct refc_ref *snapshot = refc_allocate(sizeof(int));
+	/* Blocks may be less aligned than an int with REFC_H_ALIGN */
+	memset(refc_access(snapshot), 0, sizeof(int));
+	refc_atomic_slot_store(&slot, snapshot);
+	struct refc_ref *loaded = refc_atomic_slot_load_retain(&slot);
+	assert(loaded == snapshot);
+	refc_release(loaded);
+#ifndef REFC_H_SINGLE_THREADED
+	pthread_t readers[4];
+	for (size_t i = 0; i < 4; i++) {
+		assert(pthread_create(&readers[i], NULL, &load_slot_thread, &slot) == 0);
+	}
+	for (int i = 1; i <= 1000; i++) {
+		snapshot = refc_allocate(sizeof(int));
+		int value = i < 1000 ? i : -1;
+		memcpy(refc_access(snapshot), &value, sizeof(value));
+		refc_atomic_slot_store(&slot, snapshot);
+	}
+	for (size_t i = 0; i < 4; i++) {
+		assert(pthread_join(readers[i], NULL) == 0);
+	}
+#endif
+	refc_atomic_slot_store(&slot, NULL);
+	drain();
+
+	/* Arena blocks are destructed on release and freed with the arena */
+	struct refc_arena *arena = refc_arena_create();
+	assert(arena != NULL);
+	dtor_called = 0;
+	struct refc_ref *scoped = refc_arena_allocate(arena, 512, &dtor);
+	assert(scoped != NULL);
+	for (size_t i = 0; i < 1024; i++) {
+		assert(refc_arena_allocate(arena, 100, NULL) != NULL);
+	}
+	assert(refc_arena_allocate(arena, 1 << 20, NULL) != NULL);
+	refc_release(scoped);
+	drain();
+	assert(dtor_called == 1);
+	refc_arena_destroy(arena);
+
+#ifdef REFC_H_POOL
+	/* Released blocks are reused for allocations of the same size class */
+	struct refc_ref *pooled = refc_allocate(24);
+	refc_release(pooled);
+	drain();
+	assert(refc_allocate(32) == pooled);
+	refc_release(pooled);
+	drain();
+
+#if !defined(REFC_H_SINGLE_THREADED) && !defined(REFC_H_BIASED) && !defined(REFC_H_DEFERRED)
+	/* Blocks released on another thread are handed back to their owner */
+	assert(refc_allocate(32) == pooled);
+	pthread_t thread;
+	assert(pthread_create(&thread, NULL, release_thread, pooled) == 0);
+	assert(pthread_join(thread, NULL) == 0);
+	assert(atomic_load(&(pooled->pool_owner->pool_remote)) == pooled);
+	refc_pool_reclaim(pooled->pool_owner);
+	assert(refc_allocate(32) == pooled);
+	refc_release(pooled);
+#endif
+
+	/* Blocks past the largest size class are not pooled */
+	struct refc_ref *large = refc_allocate(1 << 20);
+	assert(large != NULL);
+	refc_release(large);
+	drain();
+#endif
+
+#if defined(REFC_H_ITERATIVE) && !defined(REFC_H_DEFERRED)
+	/* Releasing a long chain does not recurse */
+	dtor_count = 0;
+	struct refc_ref *list = NULL;
+	for (size_t i = 0; i < 1000000; i++) {
+		struct refc_ref *parent = refc_allocate_dtor(sizeof(struct refc_ref *), &release_child);
+		*(struct refc_ref **) refc_access(parent) = list;
+		list = parent;
+	}
+	refc_release(list);
+	drain();
+	assert(dtor_count == 1000000);
+
+	/* Neither when destructors release with refc_release_array */
+	dtor_count = 0;
+	list = NULL;
+	for (size_t i = 0; i < 1000000; i++) {
+		struct refc_ref *parent = refc_allocate_dtor(sizeof(struct refc_ref *), &release_child_array);
+		*(struct refc_ref **) refc_access(parent) = list;
+		list = parent;
+	}
+	refc_release_array(&list, 1);
+	drain();
+	assert(dtor_count == 1000000);
+#endif
+
+#ifdef REFC_H_DEFERRED
+	/* Unreferenced blocks wait for refc_drain, including released children */
+	dtor_count = 0;
+	struct refc_ref *chain = NULL;
+	for (size_t i = 0; i < 10; i++) {
+		struct refc_ref *parent = refc_allocate_dtor(sizeof(struct refc_ref *), &release_child);
+		*(struct refc_ref **) refc_access(parent) = chain;
+		chain = parent;
+	}
+	refc_release(chain);
+	assert(dtor_count == 0);
+	assert(refc_drain(4) == 4);
+	assert(dtor_count == 4);
+	assert(refc_drain(100) == 6);
+	assert(dtor_count == 10);
+	assert(refc_drain(100) == 0);
+
+	/* Small budgets take time in proportion to them, not to the backlog */
+	static struct refc_ref *backlog[100000];
+	for (size_t i = 0; i < 100000; i++) {
+		backlog[i] = refc_allocate(1);
+	}
+	refc_release_array(backlog, 100000);
+	for (size_t i = 0; i < 100000; i++) {
+		assert(refc_drain(1) == 1);
+	}
+	assert(refc_drain(1) == 0);
+#endif
+
+#ifdef REFC_H_WEAK
+	/* Weak references retain their target only while it is referenced */
+	dtor_called = 0;
+	struct refc_ref *cached = refc_allocate_dtor(64, &dtor);
+	struct refc_weak_ref *weak = refc_weak_create(cached);
+	struct refc_weak_ref *other = refc_weak_create(cached);
+	assert(weak != NULL && other == weak);
+	struct refc_ref *locked = refc_weak_lock(weak);
+	assert(locked == cached);
+	refc_release(locked);
+	refc_release(cached);
+	drain();
+	assert(dtor_called == 1);
+	assert(refc_weak_lock(weak) == NULL);
+	refc_weak_release(weak);
+	assert(refc_weak_lock(other) == NULL);
+	refc_weak_release(other);
+#endif
+
+#ifdef REFC_H_EPOCH
+	/* Blocks released during an epoch outlive it */
+	dtor_called = 0;
+	struct refc_ref *borrowed = refc_allocate_dtor(64, &dtor);
+	assert(refc_epoch_enter());
+	assert(refc_epoch_enter());
+	refc_release(borrowed);
+	refc_epoch_exit();
+	assert(dtor_called == 0);
+	refc_epoch_exit();
+	drain();
+	assert(dtor_called == 1);
+
+#ifndef REFC_H_SINGLE_THREADED
+	/* Including blocks released by other threads */
+	dtor_called = 0;
+	borrowed = refc_allocate_dtor(64, &dtor);
+	assert(refc_epoch_enter());
+	pthread_t epoch_releaser;
+	assert(pthread_create(&epoch_releaser, NULL, &release_thread, borrowed) == 0);
+	assert(pthread_join(epoch_releaser, NULL) == 0);
+	*(unsigned char *) refc_access(borrowed) = 1;
+	assert(dtor_called == 0);
+	refc_epoch_exit();
+#ifdef REFC_H_BIASED
+	refc_release(refc_allocate(16));
+#endif
+	drain();
+	assert(dtor_called == 1);
+
+#if !defined(REFC_H_BIASED) && !defined(REFC_H_DEFERRED)
+	/* Threads that only borrow advance the epoch every so many exits */
+	dtor_called = 0;
+	borrowed = refc_allocate_dtor(64, &dtor);
+	assert(refc_epoch_enter());
+	refc_thread_current->epoch_exits = 0;
+	assert(pthread_create(&epoch_releaser, NULL, &release_thread, borrowed) == 0);
+	assert(pthread_join(epoch_releaser, NULL) == 0);
+	size_t exits = 0;
+	while (dtor_called == 0) {
+		refc_epoch_exit();
+		exits++;
+		assert(refc_epoch_enter());
+	}
+	refc_epoch_exit();
+	assert(exits == REFC_EPOCH_ADVANCE_INTERVAL);
+#endif
+#endif
+#endif
+
+	/* Padded blocks start a cache line, after the line their header starts on, and end one */
+	dtor_called = 0;
+	struct refc_ref *padded = refc_allocate_flags(100, &dtor, REFC_ALLOCATE_PADDED);
+	assert(padded != NULL);
+	assert((uintptr_t) padded % _Alignof(struct refc_ref) == 0);
+	assert((uintptr_t) refc_access(padded) % REFC_H_CACHE_LINE == REFC_PADDED_SKEW);
+	assert((uintptr_t) padded / REFC_H_CACHE_LINE < (uintptr_t) refc_access(padded) / REFC_H_CACHE_LINE);
+	memset(refc_access(padded), 1, 128 - REFC_PADDED_SKEW);
+	refc_retain(padded);
+	refc_release(padded);
+	refc_release(padded);
+	drain();
+	assert(dtor_called == 1);
+	struct refc_ref *unpadded = refc_allocate_flags(8, NULL, 0);
+	assert(unpadded != NULL);
+	refc_release(unpadded);
+
+#ifdef REFC_H_SHARDED
+	/* Sharded blocks outlive all their references until they are unsharded */
+	dtor_called = 0;
+	struct refc_ref *sharded = refc_allocate_flags(64, &dtor, REFC_ALLOCATE_SHARDED | REFC_ALLOCATE_PADDED);
+	assert(sharded != NULL);
+	refc_retain_n(sharded, 3);
+	assert(pthread_create(&releaser, NULL, release_thread, sharded) == 0);
+	assert(pthread_join(releaser, NULL) == 0);
+	assert(pthread_create(&releaser, NULL, release_thread, sharded) == 0);
+	assert(pthread_join(releaser, NULL) == 0);
+	refc_release(sharded);
+	drain();
+	assert(dtor_called == 0);
+	refc_unshard(sharded);
+	refc_unshard(sharded);
+	refc_retain(sharded);
+	refc_release_n(sharded, 1);
+	assert(pthread_create(&releaser, NULL, release_thread, sharded) == 0);
+	assert(pthread_join(releaser, NULL) == 0);
+	drain();
+	assert(dtor_called == 1);
+#endif
+
+#ifdef REFC_H_DEBUG
+	/* Blocks are registered as live until they are freed */
+	drain();
+	size_t live_count = refc_debug_live();
+	struct refc_ref *leaked = refc_allocate(24);
+	struct refc_ref *leaked_child = refc_allocate(8);
+	assert(refc_link(leaked, leaked_child));
+	assert(refc_debug_live() == live_count + 2);
+	refc_release(leaked);
+	refc_release(leaked_child);
+	drain();
+	assert(refc_debug_live() == live_count);
+#endif
+
+#ifdef REFC_H_STATS
+	/* Blocks and references are counted until the blocks are freed */
+	drain();
+	struct refc_stats before = refc_stats_get();
+	struct refc_ref *counted = refc_allocate_dtor(100, &dtor);
+	refc_retain(counted);
+	struct refc_stats during = refc_stats_get();
+	assert(during.allocations == before.allocations + 1);
+	assert(during.live_blocks == before.live_blocks + 1);
+	assert(during.live_bytes == before.live_bytes + 100);
+	assert(during.retains == before.retains + 1);
+	refc_release(counted);
+	refc_release(counted);
+	drain();
+	struct refc_stats after = refc_stats_get();
+	assert(after.frees == before.frees + 1);
+	assert(after.live_blocks == before.live_blocks);
+	assert(after.live_bytes == before.live_bytes);
+	assert(after.releases == before.releases + 2);
+	assert(after.destructor_ns >= before.destructor_ns);
+#endif
+
+#ifdef REFC_H_PROFILE
+	/* Sampled blocks are reported by tag until they are freed */
+	refc_profile_set_rate(1);
+	const char *previous_tag = refc_profile_tag("tests");
+	struct refc_ref *sampled[3];
+	for (size_t i = 0; i < 3; i++) {
+		sampled[i] = refc_allocate(32);
+	}
+	refc_profile_tag(previous_tag);
+	struct refc_profile_site site = { 0 };
+	assert(refc_profile_report(&find_site, &site));
+	assert(site.blocks == 3);
+	assert(site.bytes == 96);
+	assert(site.estimated_bytes == 96);
+	for (size_t i = 0; i < 3; i++) {
+		refc_release(sampled[i]);
+	}
+	drain();
+	site.blocks = 0;
+	assert(refc_profile_report(&find_site, &site));
+	assert(site.blocks == 0);
+	refc_profile_set_rate(REFC_H_PROFILE_RATE);
+#endif
+
+#ifdef REFC_H_SCOPE
+	/* Borrowed blocks outlive the outermost scope that borrowed them */
+	dtor_called = 0;
+	struct refc_ref *local = refc_allocate_dtor(64, &dtor);
+	refc_scope outer = refc_scope_enter();
+	assert(refc_scope_borrow(local));
+	refc_scope inner = refc_scope_enter();
+	assert(refc_scope_borrow(local));
+	refc_release(local);
+	refc_scope_exit(inner);
+	*(unsigned char *) refc_access(local) = 1;
+	assert(dtor_called == 0);
+	refc_scope_exit(outer);
+	drain();
+	assert(dtor_called == 1);
+
+	/* Blocks retained again before the scope is exited stay alive */
+	dtor_called = 0;
+	local = refc_allocate_dtor(64, &dtor);
+	outer = refc_scope_enter();
+	assert(refc_scope_borrow(local));
+	refc_release(local);
+	refc_retain(local);
+	refc_scope_exit(outer);
+	drain();
+	assert(dtor_called == 0);
+	refc_release(local);
+	drain();
+	assert(dtor_called == 1);
+
+	/* Each of many borrowed blocks is kept alive by its outermost scope */
+	dtor_count = 0;
+	static struct refc_ref *kept[10000];
+	outer = refc_scope_enter();
+	for (size_t i = 0; i < 10000; i++) {
+		kept[i] = refc_allocate_dtor(8, &counting_dtor);
+		assert(refc_scope_borrow(kept[i]));
+	}
+	inner = refc_scope_enter();
+	for (size_t i = 0; i < 10000; i += 2) {
+		assert(refc_scope_borrow(kept[i]));
+	}
+	for (size_t i = 0; i < 10000; i++) {
+		struct refc_ref *temporary = refc_allocate_dtor(8, &counting_dtor);
+		assert(refc_scope_borrow(temporary));
+		refc_release(temporary);
+		refc_release(kept[i]);
+	}
+	refc_scope_exit(inner);
+	drain();
+	assert(dtor_count == 10000);
+	refc_scope_exit(outer);
+	drain();
+	assert(dtor_count == 20000);
+#endif
+
+#ifdef REFC_H_COLLECT
+	/* Cycles of links are collected once nothing else references them */
+	dtor_count = 0;
+	struct refc_ref *ring[3];
+	for (size_t i = 0; i < 3; i++) {
+		ring[i] = refc_allocate_dtor(sizeof(struct refc_ref *), &release_child);
+	}
+	for (size_t i = 0; i < 3; i++) {
+		refc_retain(ring[(i + 1) % 3]);
+		*(struct refc_ref **) refc_access(ring[i]) = ring[(i + 1) % 3];
+		assert(refc_link(ring[i], ring[(i + 1) % 3]));
+	}
+	refc_retain(ring[0]);
+	for (size_t i = 0; i < 3; i++) {
+		refc_release(ring[i]);
+	}
+	assert(refc_collect() == 0);
+	refc_release(ring[0]);
+	assert(dtor_count == 0);
+	assert(refc_collect() == 3);
+	assert(dtor_count == 3);
+	assert(refc_collect() == 0);
+
+	/* A garbage cycle releases the live blocks it links to only once */
+	dtor_count = 0;
+	struct refc_ref *live = refc_allocate_dtor(sizeof(int), &counting_dtor);
+	struct refc_ref *pair[2];
+	for (size_t i = 0; i < 2; i++) {
+		pair[i] = refc_allocate_dtor(2 * sizeof(struct refc_ref *), &release_children);
+	}
+	for (size_t i = 0; i < 2; i++) {
+		struct refc_ref **children = refc_access(pair[i]);
+		refc_retain(pair[1 - i]);
+		refc_retain(live);
+		children[0] = pair[1 - i];
+		children[1] = live;
+		assert(refc_link(pair[i], pair[1 - i]));
+		assert(refc_link(pair[i], live));
+	}
+	refc_release(pair[0]);
+	refc_release(pair[1]);
+	assert(refc_collect() == 2);
+	assert(dtor_count == 2);
+	assert(refc_collect() == 0);
+	refc_release(live);
+	drain();
+	assert(dtor_count == 3);
+#endif
 }